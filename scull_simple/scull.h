@@ -1,7 +1,10 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/semaphore.h>
+#include <linux/wait.h>
 #include "scull_ioctl.h"
 
 // uncomment NDEBUG to enable ALOGV
@@ -41,19 +44,58 @@ struct scull_qset {
     struct scull_qset *next;
 };
 
+/*
+ * byte range reserved by an O_APPEND write, on scull_dev.appends while
+ * the data are copied in without sem
+ */
+struct scull_append {
+    unsigned long start;
+    struct list_head node;
+};
+
 struct scull_dev {
     struct scull_qset *data;    /* pointer to quantum set */
     int quantum;                /* the current quantum size */
     int qset;                   /* the current array size */
+    int quantum_shift;          /* log2(quantum), -1 if not a power of two */
+    int qset_shift;             /* log2(qset), -1 if not a power of two */
     unsigned long size;         /* amount of data stored here */
+    unsigned long generation;   /* bumped by scull_trim, stales cached qsets */
     unsigned int access_key;    /* used by sculluid and scullpriv */
+    int numa_policy;            /* SCULL_NUMA_* placement of new quanta */
+    int numa_node;              /* node for SCULL_NUMA_PREFERRED */
+    int numa_next;              /* last node used by SCULL_NUMA_INTERLEAVE */
+    struct list_head appends;   /* scull_append ranges being copied, oldest first */
+    int nappend;                /* number of them */
+    wait_queue_head_t append_wq;    /* trim waits here for the appenders */
     struct semaphore sem;       /* main mutex to lock file ops*/
     struct semaphore proc_sem;  /* mutex for /proc/ reading */
     struct cdev cdev;           /* char device struct */
 };
+
+/*
+ * per open file state, in filp->private_data. A reader caches the last
+ * qset it read from, valid as long as the device generation is unchanged,
+ * and counts how many reads in a row went on where the previous one ended.
+ */
+struct scull_file {
+    struct scull_dev *dev;
+    struct scull_qset *qptr;    /* last qset read from */
+    int64_t item;               /* its number */
+    unsigned long generation;   /* dev->generation qptr was taken at */
+    loff_t next_pos;            /* where the last read ended */
+    int seq;                    /* sequential reads in a row */
+    int advice;                 /* SCULL_ADV_* access hint */
+    int64_t dropped;            /* qsets below this one were freed by DONTNEED */
+    unsigned long drop_generation;  /* dev->generation dropped counts at */
+    struct scull_fstats stats;  /* per file counters, advice filled on GFSTATS */
+};
+
 extern struct scull_dev gSdev[];
 extern int gScull_major, gScull_minor, gDev_nums;
 extern int gScull_qset, gScull_quantum;
+extern char *gScull_ckpt;
+extern int gScull_numa_policy, gScull_numa_node;
 
 /*
  * file operations of scull
@@ -67,7 +109,48 @@ long (scull_ioctl) (struct file *, unsigned int, unsigned long);
 int (scull_trim) (struct scull_dev *);
 
 struct scull_qset *scull_follow(struct scull_dev *, int);
+struct scull_qset *scull_qset_alloc(struct scull_dev *, int);
+void *scull_quantum_alloc(struct scull_dev *, struct scull_qset *, int);
 int scull_alloc(struct scull_dev *);
+int scull_set_numa(struct scull_dev *, int, int);
+int scull_set_advice(struct scull_file *, int, loff_t);
+int scull_drain_appends(struct scull_dev *);
+void scull_geometry(struct scull_dev *);
+unsigned long scull_data_end(struct scull_dev *);
+
+/*
+ * split the device offset pos into the qset number, the quantum within it
+ * and the byte within that. Geometry with power-of-two quantum and qset
+ * (both shifts set) takes shifts and masks, any other one the divisions.
+ */
+static inline void scull_split(loff_t pos, int quantum, int qset, int quantum_shift, \
+        int qset_shift, int64_t *item, int *q_pos, int *r_pos)
+{
+    int32_t item_r;
+
+    if(quantum_shift >= 0 && qset_shift >= 0) {
+        *item = pos >> (quantum_shift + qset_shift);
+        *q_pos = (pos >> quantum_shift) & (qset - 1);
+        *r_pos = pos & (quantum - 1);
+        return;
+    }
+    *item = div_s64_rem(pos, quantum * qset, &item_r);
+    *q_pos = item_r / quantum;
+    *r_pos = item_r % quantum;
+}
+
+static inline void scull_locate(struct scull_dev *dev, loff_t pos, int64_t *item, \
+        int *q_pos, int *r_pos)
+{
+    scull_split(pos, dev->quantum, dev->qset, dev->quantum_shift, dev->qset_shift, \
+            item, q_pos, r_pos);
+}
+
+/*
+ * checkpoint and restore of all devices to/from a backing file
+ */
+int scull_checkpoint(const char *path);
+int scull_restore(const char *path);
 
 /*
  * For /proc file implementations
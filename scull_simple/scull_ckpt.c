@@ -0,0 +1,467 @@
+/*
+ * source file dedicated to checkpoint and restore of scull devices
+ *
+ * Layout of the backing file, all fields in native byte order:
+ *
+ *   struct scull_ckpt_hdr
+ *   struct scull_ckpt_index[ndevs]     offset and length of each device section
+ *   device sections, each of them:
+ *       struct scull_ckpt_dev
+ *       nquanta * (struct scull_ckpt_quantum + quantum bytes)
+ *
+ * Only allocated quanta are stored, and the last one is cut at the device
+ * size, so holes and the unused tail cost nothing. Data go through a large
+ * staging buffer to keep the kernel writes and reads big and sequential.
+ *
+ * A checkpoint is written to "<path>.tmp" and only renamed over path once
+ * it is complete and synced, so a failed one leaves the last good one be.
+ */
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/mount.h>
+#include <linux/mutex.h>
+#include <linux/namei.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/vmalloc.h>
+#include "scull.h"
+
+#define SCULL_CKPT_MAGIC    0x53434b50  /* "SCKP" */
+#define SCULL_CKPT_VERSION  1
+#define SCULL_CKPT_CHUNK    (1 << 20)
+
+struct scull_ckpt_hdr {
+    u32 magic;
+    u32 version;
+    u32 ndevs;
+    u32 reserved;
+};
+
+struct scull_ckpt_index {
+    u64 offset;
+    u64 length;
+};
+
+struct scull_ckpt_dev {
+    u32 quantum;
+    u32 qset;
+    u64 size;
+    u64 nquanta;
+};
+
+struct scull_ckpt_quantum {
+    u64 index;      /* quantum number counted from the device begin */
+};
+
+/*
+ * one checkpoint or restore at a time, concurrent ones would write the
+ * same "<path>.tmp" or fill the devices from under each other
+ */
+static DEFINE_MUTEX(ckpt_lock);
+
+/*
+ * staging buffer of a sequential stream on the backing file,
+ * pos is the file offset of buf[0]
+ */
+struct scull_ckpt_stream {
+    struct file *filp;
+    char *buf;
+    size_t len, off;
+    loff_t pos;
+};
+
+/*
+ * per device restore job, run in its own kthread
+ */
+struct scull_restore_work {
+    struct scull_dev *dev;
+    struct file *filp;
+    struct scull_ckpt_index idx;
+    int err;
+    struct completion done;
+};
+
+static int ckpt_flush(struct scull_ckpt_stream *st)
+{
+    ssize_t ret;
+    loff_t pos = st->pos;
+
+    if(st->len == 0)
+        return 0;
+    ret = kernel_write(st->filp, st->buf, st->len, &pos);
+    if(ret < 0)
+        return ret;
+    if(ret != st->len)
+        return -EIO;
+    st->pos = pos;
+    st->len = 0;
+    return 0;
+}
+
+static int ckpt_put(struct scull_ckpt_stream *st, const void *src, size_t len)
+{
+    size_t n;
+    int err;
+
+    while(len > 0) {
+        n = min(len, (size_t)SCULL_CKPT_CHUNK - st->len);
+        memcpy(st->buf + st->len, src, n);
+        st->len += n;
+        src += n;
+        len -= n;
+        if(st->len == SCULL_CKPT_CHUNK && (err = ckpt_flush(st)))
+            return err;
+    }
+    return 0;
+}
+
+static int ckpt_get(struct scull_ckpt_stream *st, void *dst, size_t len)
+{
+    ssize_t ret;
+    size_t n;
+    loff_t pos;
+
+    while(len > 0) {
+        if(st->off == st->len) {
+            st->pos += st->len;
+            st->off = st->len = 0;
+            pos = st->pos;
+            ret = kernel_read(st->filp, st->buf, SCULL_CKPT_CHUNK, &pos);
+            if(ret < 0)
+                return ret;
+            if(ret == 0)
+                return -EIO;
+            st->len = ret;
+        }
+        n = min(len, st->len - st->off);
+        memcpy(dst, st->buf + st->off, n);
+        st->off += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * number of valid bytes in the index-th quantum, 0 if it is beyond the size
+ */
+static size_t ckpt_quantum_len(struct scull_dev *dev, u64 index)
+{
+    u64 begin = index * dev->quantum;
+
+    if(begin >= dev->size)
+        return 0;
+    return min_t(u64, dev->quantum, dev->size - begin);
+}
+
+static int ckpt_dump_dev(struct scull_ckpt_stream *st, struct scull_dev *dev)
+{
+    struct scull_ckpt_dev dhdr;
+    struct scull_ckpt_quantum qhdr;
+    struct scull_qset *qptr;
+    u64 item;
+    size_t len;
+    int q_pos, err;
+
+    if(down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if((err = scull_drain_appends(dev)))
+        return err;
+
+    dhdr.quantum = dev->quantum;
+    dhdr.qset = dev->qset;
+    dhdr.size = dev->size;
+    dhdr.nquanta = 0;
+    for(qptr = dev->data, item = 0; qptr; qptr = qptr->next, item++) {
+        for(q_pos = 0; qptr->data && q_pos < dev->qset; q_pos++)
+            if(qptr->data[q_pos] && ckpt_quantum_len(dev, item * dev->qset + q_pos))
+                dhdr.nquanta++;
+    }
+    if((err = ckpt_put(st, &dhdr, sizeof(dhdr))))
+        goto done;
+
+    for(qptr = dev->data, item = 0; qptr; qptr = qptr->next, item++) {
+        for(q_pos = 0; qptr->data && q_pos < dev->qset; q_pos++) {
+            qhdr.index = item * dev->qset + q_pos;
+            len = ckpt_quantum_len(dev, qhdr.index);
+            if(!qptr->data[q_pos] || !len)
+                continue;
+            if((err = ckpt_put(st, &qhdr, sizeof(qhdr))) ||
+                    (err = ckpt_put(st, qptr->data[q_pos], len)))
+                goto done;
+        }
+    }
+
+done:
+    up(&dev->sem);
+    return err;
+}
+
+/*
+ * rename the checkpoint written to tmp over path, both in the same directory
+ */
+static int ckpt_commit(struct file *tmp, const char *path)
+{
+    struct dentry *dir, *dentry = tmp->f_path.dentry, *target;
+    const char *name = kbasename(path);
+    int err;
+
+    if((err = mnt_want_write(tmp->f_path.mnt)))
+        return err;
+    dir = dget_parent(dentry);
+    lock_rename(dir, dir);
+    target = lookup_one_len(name, dir, strlen(name));
+    if(IS_ERR(target)) {
+        err = PTR_ERR(target);
+        goto out;
+    }
+    if(dentry->d_parent != dir)     // renamed under us
+        err = -ENOENT;
+    else
+        err = vfs_rename(d_inode(dir), dentry, d_inode(dir), target, NULL, 0);
+    dput(target);
+out:
+    unlock_rename(dir, dir);
+    dput(dir);
+    mnt_drop_write(tmp->f_path.mnt);
+    return err;
+}
+
+/*
+ * remove the temporary file of a failed checkpoint
+ */
+static void ckpt_discard(struct file *tmp)
+{
+    struct dentry *dir, *dentry = tmp->f_path.dentry;
+
+    if(mnt_want_write(tmp->f_path.mnt))
+        return;
+    dir = dget_parent(dentry);
+    inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+    if(dentry->d_parent == dir)
+        vfs_unlink(d_inode(dir), dentry, NULL);
+    inode_unlock(d_inode(dir));
+    dput(dir);
+    mnt_drop_write(tmp->f_path.mnt);
+}
+
+static int checkpoint_all(const char *path)
+{
+    struct scull_ckpt_stream st = { .len = 0 };
+    struct scull_ckpt_hdr hdr = {
+        .magic = SCULL_CKPT_MAGIC,
+        .version = SCULL_CKPT_VERSION,
+        .ndevs = gDev_nums,
+    };
+    struct scull_ckpt_index *index;
+    size_t index_size = gDev_nums * sizeof(*index);
+    char *tmp_path;
+    loff_t pos = 0;
+    ssize_t ret;
+    int i, err = -ENOMEM;
+
+    index = kcalloc(gDev_nums, sizeof(*index), GFP_KERNEL);
+    st.buf = vmalloc(SCULL_CKPT_CHUNK);
+    tmp_path = kasprintf(GFP_KERNEL, "%s.tmp", path);
+    if(!index || !st.buf || !tmp_path)
+        goto out_free;
+
+    st.filp = filp_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if(IS_ERR(st.filp)) {
+        err = PTR_ERR(st.filp);
+        goto out_free;
+    }
+
+    // device sections go first, header and index are written at last
+    st.pos = sizeof(hdr) + index_size;
+    for(i = 0; i < gDev_nums; i++) {
+        index[i].offset = st.pos + st.len;
+        if((err = ckpt_dump_dev(&st, &gSdev[i])))
+            goto out_close;
+        index[i].length = st.pos + st.len - index[i].offset;
+    }
+    if((err = ckpt_flush(&st)))
+        goto out_close;
+
+    ret = kernel_write(st.filp, &hdr, sizeof(hdr), &pos);
+    if(ret == sizeof(hdr))
+        ret = kernel_write(st.filp, index, index_size, &pos);
+    if(ret < 0)
+        err = ret;
+    else if(ret != index_size)
+        err = -EIO;
+    else if(!(err = vfs_fsync(st.filp, 0)))
+        err = ckpt_commit(st.filp, path);
+    ALOGD("scull: checkpoint of %d devices to %s, %lld bytes, err=%d\n", \
+            gDev_nums, path, st.pos, err);
+
+out_close:
+    if(err)
+        ckpt_discard(st.filp);
+    filp_close(st.filp, NULL);
+out_free:
+    kfree(tmp_path);
+    vfree(st.buf);
+    kfree(index);
+    return err;
+}
+
+static int restore_dev(struct scull_restore_work *w)
+{
+    struct scull_dev *dev = w->dev;
+    struct scull_ckpt_stream st = {
+        .filp = w->filp,
+        .pos = w->idx.offset,
+    };
+    struct scull_ckpt_dev dhdr;
+    struct scull_ckpt_quantum qhdr;
+    struct scull_qset *qptr;
+    void *quantum;
+    u64 i, item;
+    size_t len;
+    int q_pos, err;
+
+    st.buf = vmalloc(SCULL_CKPT_CHUNK);
+    if(!st.buf)
+        return -ENOMEM;
+
+    if(down_interruptible(&dev->sem)) {
+        vfree(st.buf);
+        return -ERESTARTSYS;
+    }
+    if((err = scull_drain_appends(dev))) {
+        vfree(st.buf);
+        return err;
+    }
+
+    scull_trim(dev);
+    if((err = ckpt_get(&st, &dhdr, sizeof(dhdr))))
+        goto done;
+    if(!dhdr.quantum || !dhdr.qset || dhdr.quantum > INT_MAX / dhdr.qset) {
+        err = -EINVAL;
+        goto done;
+    }
+    dev->quantum = dhdr.quantum;
+    dev->qset = dhdr.qset;
+    scull_geometry(dev);
+    dev->size = dhdr.size;
+
+    for(i = 0; i < dhdr.nquanta; i++) {
+        if((err = ckpt_get(&st, &qhdr, sizeof(qhdr))))
+            goto done;
+        if(!(len = ckpt_quantum_len(dev, qhdr.index))) {
+            err = -EINVAL;
+            goto done;
+        }
+        item = qhdr.index;
+        q_pos = do_div(item, dev->qset);    // item becomes the qset number
+        qptr = scull_qset_alloc(dev, item);
+        quantum = qptr ? scull_quantum_alloc(dev, qptr, q_pos) : NULL;
+        if(!quantum) {
+            err = -ENOMEM;
+            goto done;
+        }
+        if((err = ckpt_get(&st, quantum, len)))
+            goto done;
+    }
+
+done:
+    if(err)
+        scull_trim(dev);
+    up(&dev->sem);
+    vfree(st.buf);
+    return err;
+}
+
+static int restore_thread(void *data)
+{
+    struct scull_restore_work *w = data;
+
+    w->err = restore_dev(w);
+    complete(&w->done);
+    return 0;
+}
+
+static int restore_all(const char *path)
+{
+    struct scull_ckpt_hdr hdr;
+    struct scull_ckpt_index *index = NULL;
+    struct scull_restore_work *works = NULL;
+    struct task_struct *task;
+    struct file *filp;
+    loff_t pos = 0;
+    ssize_t ret;
+    int i, ndevs, err = 0;
+
+    filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if(IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    ret = kernel_read(filp, &hdr, sizeof(hdr), &pos);
+    if(ret != sizeof(hdr) || hdr.magic != SCULL_CKPT_MAGIC || \
+            hdr.version != SCULL_CKPT_VERSION) {
+        err = ret < 0 ? ret : -EINVAL;
+        goto out;
+    }
+
+    ndevs = min_t(u32, hdr.ndevs, gDev_nums);
+    index = kcalloc(ndevs, sizeof(*index), GFP_KERNEL);
+    works = kcalloc(ndevs, sizeof(*works), GFP_KERNEL);
+    if(!index || !works) {
+        err = -ENOMEM;
+        goto out;
+    }
+    ret = kernel_read(filp, index, ndevs * sizeof(*index), &pos);
+    if(ret != ndevs * sizeof(*index)) {
+        err = ret < 0 ? ret : -EINVAL;
+        goto out;
+    }
+
+    // restore the devices in parallel, fall back to inline if no thread
+    for(i = 0; i < ndevs; i++) {
+        works[i].dev = &gSdev[i];
+        works[i].filp = filp;
+        works[i].idx = index[i];
+        init_completion(&works[i].done);
+        task = kthread_run(restore_thread, &works[i], "scull_restore/%d", i);
+        if(IS_ERR(task))
+            restore_thread(&works[i]);
+    }
+    for(i = 0; i < ndevs; i++) {
+        wait_for_completion(&works[i].done);
+        if(works[i].err && !err)
+            err = works[i].err;
+    }
+    ALOGD("scull: restored %d devices from %s, err=%d\n", ndevs, path, err);
+
+out:
+    kfree(works);
+    kfree(index);
+    filp_close(filp, NULL);
+    return err;
+}
+
+int scull_checkpoint(const char *path)
+{
+    int err;
+
+    mutex_lock(&ckpt_lock);
+    err = checkpoint_all(path);
+    mutex_unlock(&ckpt_lock);
+    return err;
+}
+
+int scull_restore(const char *path)
+{
+    int err;
+
+    mutex_lock(&ckpt_lock);
+    err = restore_all(path);
+    mutex_unlock(&ckpt_lock);
+    return err;
+}
@@ -1,4 +1,5 @@
 #include <linux/ioctl.h>
+#include <linux/types.h>
 /*
  * S => Set, thru a pointer
  * T => Tell, thru argument value
@@ -21,7 +22,65 @@ enum {
     XQSET,
     HQUANTUM,
     HQSET,
-    MAXNR   = 13,
+    CKPT,
+    RESTORE,
+    SNUMA,
+    GNUMA,
+    TADVICE,
+    GFSTATS,
+    MAXNR   = 19,
+};
+
+/*
+ * NUMA placement policy of quanta, per device
+ * LOCAL: first touch, on the node of the writing cpu
+ * PREFERRED: on node, fall back to others if it is out of memory
+ * INTERLEAVE: round-robin over all memory nodes
+ */
+enum {
+    SCULL_NUMA_LOCAL    = 0,
+    SCULL_NUMA_PREFERRED,
+    SCULL_NUMA_INTERLEAVE,
+    SCULL_NUMA_MAX,
+};
+
+struct scull_numa {
+    int policy;
+    int node;
+};
+
+/*
+ * access pattern hint of an open file, fadvise style
+ * NORMAL: prefetch the next quantum once reads turn out sequential
+ * SEQUENTIAL: always prefetch the next quantum
+ * RANDOM: never prefetch
+ * NOREUSE: never prefetch, and write data around the cpu caches
+ * DONTNEED: free the quanta the file has read past, so a consume-once
+ *           reader releases memory as it goes; needs CAP_SYS_ADMIN as it
+ *           drops the data for every opener
+ */
+enum {
+    SCULL_ADV_NORMAL    = 0,
+    SCULL_ADV_SEQUENTIAL,
+    SCULL_ADV_RANDOM,
+    SCULL_ADV_NOREUSE,
+    SCULL_ADV_DONTNEED,
+    SCULL_ADV_MAX,
+};
+
+/*
+ * GFSTATS: counters of the open file it is issued on
+ */
+struct scull_fstats {
+    __u64 reads;
+    __u64 writes;
+    __u64 rbytes;
+    __u64 wbytes;
+    __u64 cached;       // reads that resumed from the cached qset
+    __u64 prefetched;   // quanta prefetched ahead of a read
+    __u64 dropped;      // quanta freed by DONTNEED
+    __u32 advice;       // SCULL_ADV_* in effect
+    __u32 pad;
 };
 
 /*
@@ -42,6 +101,12 @@ enum {
 #define SCULL_IOCXQSET      _IOWR(SCULL_IOC_MAGIC, XQSET, int)
 #define SCULL_IOCHQUANTUM   _IO(SCULL_IOC_MAGIC, HQUANTUM)
 #define SCULL_IOCHQSET      _IO(SCULL_IOC_MAGIC, HQSET)
+#define SCULL_IOCCKPT       _IO(SCULL_IOC_MAGIC, CKPT)
+#define SCULL_IOCRESTORE    _IO(SCULL_IOC_MAGIC, RESTORE)
+#define SCULL_IOCSNUMA      _IOW(SCULL_IOC_MAGIC, SNUMA, struct scull_numa)
+#define SCULL_IOCGNUMA      _IOR(SCULL_IOC_MAGIC, GNUMA, struct scull_numa)
+#define SCULL_IOCTADVICE    _IO(SCULL_IOC_MAGIC, TADVICE)
+#define SCULL_IOCGFSTATS    _IOR(SCULL_IOC_MAGIC, GFSTATS, struct scull_fstats)
 
 #ifndef __KERNEL__
 // for userspace cmd mapping
@@ -62,5 +127,11 @@ ioctl_t scull_ioctl[] = {
     CMD(XQSET),
     CMD(HQUANTUM),
     CMD(HQSET),
+    CMD(CKPT),
+    CMD(RESTORE),
+    CMD(SNUMA),
+    CMD(GNUMA),
+    CMD(TADVICE),
+    CMD(GFSTATS),
 };
 #endif
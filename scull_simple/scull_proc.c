@@ -49,10 +49,11 @@ ssize_t scull_read_procmem(struct file *filp, char __user *buffer, size_t count,
             len += sprintf(buf+len, "\tquantum set-%d at %8p, data at %8p\n", \
                     j, qset, qset->data);
             data = qset->data;
-            // struct qset::data is NULL terminated
-            for(k = 0; data && *data && len <= limit; ++data, ++k)
-                len += sprintf(buf+len, "\t\tNO.%d data: %8p\n", \
-                        k, *data);
+            // struct qset::data holds sdev->qset slots, unallocated ones NULL
+            for(k = 0; data && k < sdev->qset && len <= limit; ++k)
+                if(data[k])
+                    len += sprintf(buf+len, "\t\tNO.%d data: %8p\n", \
+                            k, data[k]);
         }
 
         up(&sdev->proc_sem);
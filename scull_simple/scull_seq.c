@@ -1,4 +1,7 @@
+#include <linux/mm.h>
+#include <linux/nodemask.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
 #include "scull.h"
 
 
@@ -44,6 +47,39 @@ void * (scull_seq_next) (struct seq_file *m, void *v, loff_t *pos)
     return (void *) (gSdev + *pos);
 }
 
+static const char *numa_policy_name[SCULL_NUMA_MAX] = {
+    [SCULL_NUMA_LOCAL]      = "local",
+    [SCULL_NUMA_PREFERRED]  = "preferred",
+    [SCULL_NUMA_INTERLEAVE] = "interleave",
+};
+
+/*
+ * print how many quanta of sdev live on each memory node
+ */
+static void scull_seq_show_numa(struct seq_file *m, struct scull_dev *sdev)
+{
+    unsigned long *nquanta;
+    struct scull_qset *qset;
+    int i, node;
+
+    seq_printf(m, "\tnuma policy-%s, node-%d\n", \
+            numa_policy_name[sdev->numa_policy], sdev->numa_node);
+    nquanta = kcalloc(nr_node_ids, sizeof(*nquanta), GFP_KERNEL);
+    if(!nquanta)
+        return;
+
+    for(qset = sdev->data; qset; qset = qset->next)
+        for(i = 0; qset->data && i < sdev->qset; i++)
+            if(qset->data[i])
+                nquanta[page_to_nid(virt_to_page(qset->data[i]))]++;
+
+    seq_puts(m, "\tquanta per node:");
+    for_each_node_state(node, N_MEMORY)
+        seq_printf(m, " node%d-%lu", node, nquanta[node]);
+    seq_putc(m, '\n');
+    kfree(nquanta);
+}
+
 int (scull_seq_show) (struct seq_file *m, void *v)
 {
     int i, j;
@@ -56,14 +92,16 @@ int (scull_seq_show) (struct seq_file *m, void *v)
         return -ERESTARTSYS;
     seq_printf(m, "Scull device-%li: qset-%i, quantum-%i, total size-%li\n", \
             (sdev-gSdev), sdev->qset, sdev->quantum, sdev->size);
+    scull_seq_show_numa(m, sdev);
     for(qset = sdev->data, i = 0; qset; qset = qset->next, i++) {
         seq_printf(m, "\tquantum set-%d at %8p, data at %8p\n", \
                 i, qset, qset->data);
         data = qset->data;
-        // struct qset::data is NULL terminated
-        for(j = 0; data && *data; ++data, ++j)
-            seq_printf(m, "\t\tNO.%d data: %8p\n", \
-                    j, *data);
+        // struct qset::data holds sdev->qset slots, unallocated ones NULL
+        for(j = 0; data && j < sdev->qset; ++j)
+            if(data[j])
+                seq_printf(m, "\t\tNO.%d data: %8p\n", \
+                        j, data[j]);
     }
 
     up(&sdev->proc_sem);
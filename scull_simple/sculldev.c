@@ -2,9 +2,13 @@
 #include <linux/errno.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
 #include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/nodemask.h>
+#include <linux/numa.h>
+#include <linux/prefetch.h>
 #include <linux/proc_fs.h>
 #include <linux/string.h>
 #include <linux/types.h>
@@ -39,6 +43,15 @@ module_param(gDev_nums, int, S_IRUGO);
 module_param(gScull_qset, int, S_IRUGO);
 module_param(gScull_quantum, int, S_IRUGO);
 
+// backing file for checkpoint/restore, restored on load and saved on unload
+char *gScull_ckpt = NULL;
+module_param(gScull_ckpt, charp, S_IRUGO);
+
+// default NUMA placement of quanta, see SCULL_NUMA_* in scull_ioctl.h
+int gScull_numa_policy = SCULL_NUMA_LOCAL, gScull_numa_node = NUMA_NO_NODE;
+module_param(gScull_numa_policy, int, S_IRUGO);
+module_param(gScull_numa_node, int, S_IRUGO);
+
 /*
  * wrap the device number allocation and free
  * return 0 on success
@@ -91,16 +104,29 @@ static int scull_dev_init(struct scull_dev *sdev, int index)
 
 /*
  * a private function dedicated to reset and reallocate qset structure,
- * called on open driver, return 0 on success, -1 on failure
+ * called on open driver, return 0 on success, -1 on failure. A positive
+ * quantum or qset becomes the new geometry, set only once the device is
+ * trimmed, since trim frees the quanta by the geometry they were made with
  */
-static int scull_resetqset(struct file *filp)
+static int scull_resetqset(struct file *filp, int quantum, int qset)
 {
-    struct scull_dev *sdev = (struct scull_dev *) filp->private_data;
+    struct scull_dev *sdev = ((struct scull_file *)filp->private_data)->dev;
     int err;
 
     if(down_interruptible(&sdev->sem))
         return -ERESTARTSYS;
+    if((err = scull_drain_appends(sdev)))
+        return err;
+    quantum = quantum > 0 ? quantum : sdev->quantum;
+    qset = qset > 0 ? qset : sdev->qset;
+    if(quantum > INT_MAX / qset) {
+        up(&sdev->sem);
+        return -EINVAL;
+    }
     scull_trim(sdev);
+    sdev->quantum = quantum;
+    sdev->qset = qset;
+    scull_geometry(sdev);
     // at least we should allocate the data quantums for the first time
     kfree(sdev->data);
     err = scull_alloc(sdev);
@@ -125,7 +151,9 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
 {
     int err = 0, retval = 0;
     int tmp;
-    struct scull_dev *sdev = (struct scull_dev *) filp->private_data;
+    struct scull_numa numa;
+    struct scull_file *sfile = (struct scull_file *)filp->private_data;
+    struct scull_dev *sdev = sfile->dev;
 
     // checking cmd type and NR to assure this is a valid scull cmd
     if(_IOC_TYPE(cmd) != SCULL_IOC_MAGIC) return -ENOTTY;
@@ -151,8 +179,7 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
                 retval = -EFAULT;
             else if(retval == 0) {
                 ALOGD("ioctl: set quantum to %d\n", tmp);
-                sdev->quantum = tmp;
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, tmp, 0);
             }
 			break;
         case SQSET:
@@ -164,8 +191,7 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
                 retval = -EFAULT;
             else if(retval == 0) {
                 ALOGD("ioctl: set qset to %d\n", tmp);
-                sdev->qset = tmp;
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, 0, tmp);
             }
 			break;
         case TQUANTUM:
@@ -174,8 +200,7 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
             // check the user-provided params positive
             if((tmp = (int)argp) > 0) {
                 ALOGD("ioctl: set quantum to %d\n", tmp);
-                sdev->quantum = tmp;
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, tmp, 0);
             } else
                 retval = -EFAULT;
 			break;
@@ -185,8 +210,7 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
             // check the user-provided params positive
             if((tmp = (int)argp) > 0) {
                 ALOGD("ioctl: set qset to %d\n", tmp);
-                sdev->qset = tmp;
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, 0, tmp);
             } else
                 retval = -EFAULT;
 			break;
@@ -210,9 +234,8 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
                 retval = -EFAULT;
             else if(retval > 0) {
                 retval = __put_user(sdev->quantum, (int __user*)argp);
-                sdev->quantum = tmp;
                 ALOGD("ioctl: set quantum to %d\n", tmp);
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, tmp, 0);
             }
 			break;
         case XQSET:
@@ -223,9 +246,8 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
                 retval = -EFAULT;
             else if(retval > 0) {
                 retval = __put_user(sdev->qset, (int __user*)argp);
-                sdev->qset = tmp;
                 ALOGD("ioctl: set qset to %d\n", tmp);
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, 0, tmp);
             }
 			break;
         case HQUANTUM:
@@ -236,9 +258,8 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
                 return -EFAULT;
             else {
                 retval = sdev->quantum;
-                sdev->quantum = tmp;
                 ALOGD("ioctl: set quantum to %d\n", tmp);
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, tmp, 0);
             }
 			break;
         case HQSET:
@@ -249,18 +270,51 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
                 return -EFAULT;
             else {
                 retval = sdev->qset;
-                sdev->qset = tmp;
                 ALOGD("ioctl: set qset to %d\n", tmp);
-                retval = scull_resetqset(filp);
+                retval = scull_resetqset(filp, 0, tmp);
             }
 			break;
         case RESET:
             if(!capable(CAP_SYS_ADMIN))
                 return -EPERM;
-            sdev->qset = gScull_qset;
             ALOGD("ioctl: reset quantm and qset\n");
-            sdev->quantum = gScull_quantum;
-            retval = scull_resetqset(filp);
+            retval = scull_resetqset(filp, gScull_quantum, gScull_qset);
+            break;
+        case CKPT:
+        case RESTORE:
+            if(!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            if(!gScull_ckpt)
+                return -EINVAL;
+            if(_IOC_NR(cmd) == CKPT)
+                retval = scull_checkpoint(gScull_ckpt);
+            else
+                retval = scull_restore(gScull_ckpt);
+            break;
+        case SNUMA:
+            if(!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            if(copy_from_user(&numa, (void __user *)argp, sizeof(numa)))
+                return -EFAULT;
+            ALOGD("ioctl: set numa policy %d on node %d\n", numa.policy, numa.node);
+            retval = scull_set_numa(sdev, numa.policy, numa.node);
+            break;
+        case GNUMA:
+            numa.policy = sdev->numa_policy;
+            numa.node = sdev->numa_node;
+            retval = copy_to_user((void __user *)argp, &numa, sizeof(numa)) ? -EFAULT : 0;
+            break;
+        case TADVICE:
+            tmp = (int)argp;
+            if(tmp == SCULL_ADV_DONTNEED && !capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            ALOGV("ioctl: advise %d\n", tmp);
+            retval = scull_set_advice(sfile, tmp, filp->f_pos);
+            break;
+        case GFSTATS:
+            sfile->stats.advice = sfile->advice;
+            retval = copy_to_user((void __user *)argp, &sfile->stats, \
+                    sizeof(sfile->stats)) ? -EFAULT : 0;
             break;
         default:
             retval = -EFAULT;
@@ -272,16 +326,24 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long argp)
 
 int scull_open(struct inode *inode, struct file *filp)
 {
-    struct scull_dev *sdev;
+    struct scull_file *sfile;
+    int err;
 
-    sdev = container_of(inode->i_cdev, struct scull_dev, cdev);
-    filp->private_data = (void *)sdev;
+    sfile = kzalloc(sizeof(struct scull_file), GFP_KERNEL);
+    if(!sfile)
+        return -ENOMEM;
+    sfile->dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+    filp->private_data = (void *)sfile;
 
-    // trim the device size to 0, when opened in Write-Only mode
+    // trim the device size to 0, when opened in Write-Only mode but not
+    // for appending
     ALOGV("scull_open: calls scull_open with flag 0x%x", filp->f_flags & O_ACCMODE);
-    if((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+    if((filp->f_flags & O_ACCMODE) == O_WRONLY && !(filp->f_flags & O_APPEND)) {
         ALOGV("scull_open: in O_WRONLY mode, trim and re-alloc the data");
-        return scull_resetqset(filp);
+        if((err = scull_resetqset(filp, 0, 0))) {
+            kfree(sfile);
+            return err;
+        }
     }
 
     return 0;
@@ -289,9 +351,10 @@ int scull_open(struct inode *inode, struct file *filp)
 
 int scull_release(struct inode *inode, struct file *filp)
 {
-    // XXX release nothing right now, be careful scull_release would be called
-    //      each time device file is closed
+    // be careful scull_release would be called each time device file is
+    // closed, the data stay, only the per file state goes
     ALOGV("scull_release: release file\n");
+    kfree(filp->private_data);
     return 0;
 }
 
@@ -310,17 +373,16 @@ int scull_alloc(struct scull_dev *sdev)
 int scull_trim(struct scull_dev *sdev)
 {
     struct scull_qset *root = sdev->data, *qp, *cur;
-    void **datap;
+    int i;
     ALOGV("scull_trim: be careful, we are going to trim the data!\n");
 
     cur = root;
     while(cur) {
         qp = cur->next;
-        // release quantum set of the cur scull_qset
-        for(datap = cur->data; datap && *datap; ++datap) {
-            kfree(*datap);
-            *datap = NULL;
-        }
+        // release quantum set of the cur scull_qset, it holds sdev->qset
+        // slots with holes anywhere and no NULL terminator
+        for(i = 0; cur->data && i < sdev->qset; i++)
+            kfree(cur->data[i]);
         kfree(cur->data);
         cur->data = NULL;
         kfree(cur);
@@ -329,12 +391,24 @@ int scull_trim(struct scull_dev *sdev)
 
     sdev->data = NULL;
     sdev->size = 0UL;
+    sdev->generation++;
     // set qset and quantum if uninitialised
     sdev->qset = sdev->qset? : gScull_qset;
     sdev->quantum = sdev->quantum? : gScull_quantum;
+    scull_geometry(sdev);
     return 0;
 }
 
+/*
+ * cache the shifts of a power-of-two quantum and qset for scull_locate(),
+ * to be called whenever either of them changes on an empty device
+ */
+void scull_geometry(struct scull_dev *dev)
+{
+    dev->quantum_shift = is_power_of_2(dev->quantum) ? ilog2(dev->quantum) : -1;
+    dev->qset_shift = is_power_of_2(dev->qset) ? ilog2(dev->qset) : -1;
+}
+
 struct scull_qset *scull_follow(struct scull_dev *dev, int item)
 {
     struct scull_qset *qptr = dev->data;
@@ -345,34 +419,277 @@ struct scull_qset *scull_follow(struct scull_dev *dev, int item)
     return qptr;
 }
 
+/*
+ * the same as scull_follow(), but extend the qset list up to item,
+ * return NULL if we are out of memory
+ */
+struct scull_qset *scull_qset_alloc(struct scull_dev *dev, int item)
+{
+    struct scull_qset **qpp = &dev->data;
+
+    while(1) {
+        if(!*qpp && !(*qpp = kzalloc(sizeof(struct scull_qset), GFP_KERNEL)))
+            return NULL;
+        if(item-- <= 0)
+            break;
+        qpp = &(*qpp)->next;
+    }
+
+    return *qpp;
+}
+
+/*
+ * change the NUMA placement of quanta allocated from now on,
+ * the quanta already there stay where they are
+ */
+int scull_set_numa(struct scull_dev *dev, int policy, int node)
+{
+    if(policy < SCULL_NUMA_LOCAL || policy >= SCULL_NUMA_MAX)
+        return -EINVAL;
+    if(policy == SCULL_NUMA_PREFERRED && \
+            (node < 0 || node >= nr_node_ids || !node_online(node)))
+        return -EINVAL;
+
+    if(down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    dev->numa_policy = policy;
+    dev->numa_node = policy == SCULL_NUMA_PREFERRED ? node : NUMA_NO_NODE;
+    dev->numa_next = NUMA_NO_NODE;
+    up(&dev->sem);
+    return 0;
+}
+
+/*
+ * free the quanta of the qsets wholly below pos, which the file has read
+ * past. The qset nodes stay, so qset numbers and the qset pointers cached
+ * by other files remain valid. Called with dev->sem held
+ */
+static void scull_drop_consumed(struct scull_file *sfile, loff_t pos)
+{
+    struct scull_dev *dev = sfile->dev;
+    struct scull_qset *qptr;
+    int64_t item, n;
+    int q_pos, r_pos;
+
+    if(sfile->drop_generation != dev->generation) {
+        sfile->dropped = 0;
+        sfile->drop_generation = dev->generation;
+    }
+    // data an appender is still copying in is not consumed yet
+    pos = min_t(loff_t, pos, scull_data_end(dev));
+    scull_locate(dev, pos, &item, &q_pos, &r_pos);
+    if(item <= sfile->dropped)
+        return;
+
+    qptr = scull_follow(dev, sfile->dropped);
+    for(n = sfile->dropped; n < item && qptr; n++, qptr = qptr->next) {
+        for(q_pos = 0; qptr->data && q_pos < dev->qset; q_pos++) {
+            if(qptr->data[q_pos]) {
+                kfree(qptr->data[q_pos]);
+                sfile->stats.dropped++;
+            }
+        }
+        kfree(qptr->data);
+        qptr->data = NULL;
+    }
+    sfile->dropped = item;
+}
+
+/*
+ * set the SCULL_ADV_* access hint of an open file at offset pos,
+ * DONTNEED frees what is below pos right away
+ */
+int scull_set_advice(struct scull_file *sfile, int advice, loff_t pos)
+{
+    struct scull_dev *dev = sfile->dev;
+
+    if(advice < SCULL_ADV_NORMAL || advice >= SCULL_ADV_MAX)
+        return -EINVAL;
+
+    if(down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    sfile->advice = advice;
+    if(advice == SCULL_ADV_DONTNEED)
+        scull_drop_consumed(sfile, pos);
+    up(&dev->sem);
+    return 0;
+}
+
+/*
+ * pick the node of the next quantum, called with dev->sem held
+ */
+static int scull_quantum_node(struct scull_dev *dev)
+{
+    switch(dev->numa_policy) {
+        case SCULL_NUMA_PREFERRED:
+            return dev->numa_node;
+        case SCULL_NUMA_INTERLEAVE:
+            dev->numa_next = next_node_in(dev->numa_next, node_states[N_MEMORY]);
+            return dev->numa_next;
+        default:
+            return NUMA_NO_NODE;
+    }
+}
+
+/*
+ * make sure the q_pos-th quantum of qptr is allocated, return NULL on failure
+ */
+void *scull_quantum_alloc(struct scull_dev *dev, struct scull_qset *qptr, int q_pos)
+{
+    if(!qptr->data) {
+        qptr->data = kmalloc(dev->qset * sizeof(void *), GFP_KERNEL);
+        if(!qptr->data)
+            return NULL;
+        memset(qptr->data, 0, dev->qset * sizeof(void *));
+    }
+
+    if(!qptr->data[q_pos])
+        qptr->data[q_pos] = kmalloc_node(dev->quantum, GFP_KERNEL, scull_quantum_node(dev));
+    return qptr->data[q_pos];
+}
+
+/*
+ * wait till no O_APPEND write is copying into the device, so its quanta
+ * can go away. Called with dev->sem held, returns with it held on success
+ * and released on failure
+ */
+int scull_drain_appends(struct scull_dev *dev)
+{
+    while(dev->nappend) {
+        up(&dev->sem);
+        if(wait_event_interruptible(dev->append_wq, !READ_ONCE(dev->nappend)))
+            return -ERESTARTSYS;
+        if(down_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * end of the data readers may see: the size, or the begin of the oldest
+ * range an appender is still copying. Called with dev->sem held
+ */
+unsigned long scull_data_end(struct scull_dev *dev)
+{
+    if(list_empty(&dev->appends))
+        return dev->size;
+    return list_first_entry(&dev->appends, struct scull_append, node)->start;
+}
+
+/*
+ * qset number item of the device, resumed from the qset the file read
+ * from last time when that one is still valid and not past item, so
+ * sequential readers do not walk the list from its head on every read.
+ * Called with dev->sem held
+ */
+static struct scull_qset *scull_file_follow(struct scull_file *sfile, int64_t item)
+{
+    struct scull_dev *dev = sfile->dev;
+    struct scull_qset *qptr;
+    int64_t n;
+
+    if(sfile->qptr && sfile->generation == dev->generation && sfile->item <= item) {
+        qptr = sfile->qptr;
+        for(n = sfile->item; n < item && qptr; n++)
+            qptr = qptr->next;
+        sfile->stats.cached++;
+    } else
+        qptr = scull_follow(dev, item);
+
+    if(qptr) {
+        sfile->qptr = qptr;
+        sfile->item = item;
+        sfile->generation = dev->generation;
+    }
+    return qptr;
+}
+
+/*
+ * a sequential reader that reached the end of the q_pos-th quantum of qptr
+ * goes on with the next one: prefetch up to len bytes of it, and the next
+ * qset if it is in there. Return 1 if a quantum was prefetched
+ */
+static int scull_prefetch_next(struct scull_dev *dev, struct scull_qset *qptr, int q_pos, size_t len)
+{
+    void *next = NULL;
+
+    if(q_pos + 1 < dev->qset)
+        next = qptr->data[q_pos + 1];
+    else if((qptr = qptr->next)) {
+        prefetch(qptr);
+        if(qptr->data)
+            next = qptr->data[0];
+    }
+    if(!next)
+        return 0;
+    prefetch_range(next, min_t(size_t, len, dev->quantum));
+    return 1;
+}
+
+/*
+ * whether a read that ends a quantum should prefetch the next one
+ */
+static bool scull_want_prefetch(struct scull_file *sfile)
+{
+    switch(sfile->advice) {
+        case SCULL_ADV_SEQUENTIAL:
+            return true;
+        case SCULL_ADV_RANDOM:
+        case SCULL_ADV_NOREUSE:
+            return false;
+        default:
+            return sfile->seq > 0;
+    }
+}
+
+/*
+ * copy_from_user() of the write paths. NOREUSE files copy with
+ * non-temporal stores, so data written once do not evict the cache; what
+ * faults is left to the plain copy. Return the bytes not copied
+ */
+static unsigned long scull_copy_from_user(struct scull_file *sfile, void *to, \
+        const void __user *from, unsigned long n)
+{
+    unsigned long left;
+
+    if(sfile->advice != SCULL_ADV_NOREUSE || !access_ok(VERIFY_READ, from, n))
+        return copy_from_user(to, from, n);
+
+    pagefault_disable();
+    left = __copy_from_user_inatomic_nocache(to, from, n);
+    pagefault_enable();
+    if(left)
+        left = copy_from_user(to + n - left, from + n - left, left);
+    return left;
+}
+
 ssize_t scull_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 {
-    struct scull_dev *dev = (struct scull_dev *)filp->private_data;
-    int quantum = dev->quantum, qset = dev->qset;
-    int32_t item_size = quantum * qset; // size of each qset
+    struct scull_file *sfile = (struct scull_file *)filp->private_data;
+    struct scull_dev *dev = sfile->dev;
+    int quantum;
     int64_t item_n;
-    int32_t r_pos, item_r, q_pos;
+    int32_t r_pos, q_pos;
     struct scull_qset *qptr;
+    unsigned long end;
     ssize_t read = 0;
     ALOGV("scull_read: tries to read %d at offset %llu\n", \
             count, *f_pos);
 
     if(down_interruptible(&dev->sem))
         return -ERESTARTSYS;
-    else if(*f_pos > dev->size)
+    end = scull_data_end(dev);
+    if(*f_pos > end)
         goto done;
-    else if(*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
+    else if(*f_pos + count > end)
+        count = end - *f_pos;
 
-    // we will find the right place to read
-    // we have to take care of 64, 32 division and remainder, using <linux/math64.h>
-    item_n = div_s64_rem(*f_pos, item_size, &item_r); // which qset
-
-    qptr = scull_follow(dev, item_n);
+    // we will find the right place to read: which qset, and the position
+    // at that scull_qset
+    quantum = dev->quantum;
+    scull_locate(dev, *f_pos, &item_n, &q_pos, &r_pos);
 
-    // the position at that scull_qset
-    q_pos = item_r / quantum;
-    r_pos = item_r % quantum;
+    qptr = scull_file_follow(sfile, item_n);
 
     // what if the data is damaged?
     if(qptr == NULL || qptr->data == NULL || qptr->data[q_pos] == NULL) {
@@ -384,7 +701,19 @@ ssize_t scull_read(struct file *filp, char __user *buffer, size_t count, loff_t
         read = -EFAULT;
         goto done;
     }
+    // sequential readers get the next quantum warmed up for their next read
+    if(*f_pos != sfile->next_pos)
+        sfile->seq = 0;
+    else if(sfile->seq < INT_MAX)
+        sfile->seq++;
+    if(scull_want_prefetch(sfile) && r_pos + count == quantum)
+        sfile->stats.prefetched += scull_prefetch_next(dev, qptr, q_pos, count);
     *f_pos += count;
+    sfile->next_pos = *f_pos;
+    sfile->stats.reads++;
+    sfile->stats.rbytes += count;
+    if(sfile->advice == SCULL_ADV_DONTNEED)
+        scull_drop_consumed(sfile, *f_pos);
     read = count;
     ALOGV("scull_read: successfully read %d from device\n", \
             read);
@@ -394,51 +723,122 @@ done:
     return read;
 }
 
+/*
+ * O_APPEND write: the range at the end of the device is reserved and its
+ * quanta allocated under sem, then the data are copied in without it, so
+ * concurrent appenders only serialise on the reservation and never
+ * overwrite each other. Up to a qset worth of data goes in at once.
+ */
+static ssize_t scull_append(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
+{
+    struct scull_file *sfile = (struct scull_file *)filp->private_data;
+    struct scull_dev *dev = sfile->dev;
+    struct scull_append app;
+    struct scull_qset *qptr;
+    int quantum, qset, quantum_shift, qset_shift;
+    int64_t item_n;
+    int q_pos, r_pos;
+    unsigned long pos;
+    size_t done, n;
+    ssize_t retval = 0;
+    bool last;
+
+    if(down_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    // the geometry may only change once we are done, see scull_drain_appends()
+    quantum = dev->quantum;
+    qset = dev->qset;
+    quantum_shift = dev->quantum_shift;
+    qset_shift = dev->qset_shift;
+    count = min_t(size_t, count, quantum * qset);
+
+    for(pos = dev->size; pos < dev->size + count; pos += quantum - r_pos) {
+        scull_locate(dev, pos, &item_n, &q_pos, &r_pos);
+        qptr = scull_qset_alloc(dev, item_n);
+        if(!qptr || !scull_quantum_alloc(dev, qptr, q_pos)) {
+            up(&dev->sem);
+            return -ENOMEM;
+        }
+    }
+    app.start = dev->size;
+    dev->size += count;
+    list_add_tail(&app.node, &dev->appends);
+    dev->nappend++;
+    up(&dev->sem);
+
+    for(done = 0; done < count; done += n) {
+        scull_split(app.start + done, quantum, qset, quantum_shift, qset_shift, \
+                &item_n, &q_pos, &r_pos);
+        qptr = scull_follow(dev, item_n);
+        n = min_t(size_t, count - done, quantum - r_pos);
+        if(scull_copy_from_user(sfile, qptr->data[q_pos] + r_pos, buffer + done, n)) {
+            retval = -EFAULT;
+            break;
+        }
+    }
+    // the reserved range stays within the size, clear what the fault left
+    // of it so that readers do not see stale heap memory
+    for(; retval && done < count; done += n) {
+        scull_split(app.start + done, quantum, qset, quantum_shift, qset_shift, \
+                &item_n, &q_pos, &r_pos);
+        qptr = scull_follow(dev, item_n);
+        n = min_t(size_t, count - done, quantum - r_pos);
+        memset(qptr->data[q_pos] + r_pos, 0, n);
+    }
+
+    // readers may now go up to the next range still being copied
+    down(&dev->sem);
+    list_del(&app.node);
+    last = --dev->nappend == 0;
+    up(&dev->sem);
+    if(last)
+        wake_up_all(&dev->append_wq);
+
+    if(retval)
+        return retval;
+    *f_pos = app.start + count;
+    sfile->stats.writes++;
+    sfile->stats.wbytes += count;
+    ALOGV("scull_write: appended %zu at offset %lu\n", count, app.start);
+    return count;
+}
+
 ssize_t scull_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
 {
-    struct scull_dev *dev = (struct scull_dev *)filp->private_data;
-    int quantum, qset;
+    struct scull_file *sfile = (struct scull_file *)filp->private_data;
+    struct scull_dev *dev = sfile->dev;
+    int quantum;
     struct scull_qset *qptr;
     int64_t item_n;
-    int item_r, q_pos, r_pos, item_size;
+    int q_pos, r_pos;
     ssize_t retval = 0;
     ALOGV("scull_write: tries to write %d at offset %llu\n", \
             count, *f_pos);
 
-    quantum = dev->quantum;
-    qset = dev->qset;
-    item_size = quantum * qset;
+    if(filp->f_flags & O_APPEND)
+        return scull_append(filp, buffer, count, f_pos);
 
     if(down_interruptible(&dev->sem))
         return -ERESTARTSYS;
 
-    item_n = div_s64_rem(*f_pos, item_size, &item_r); // which qset
+    quantum = dev->quantum;
+    scull_locate(dev, *f_pos, &item_n, &q_pos, &r_pos);
 
-    qptr = scull_follow(dev, item_n);
+    qptr = scull_qset_alloc(dev, item_n);
     if(!qptr)
         goto done;
 
-    if(!qptr->data) {
-        qptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-        if(!qptr->data)
-            goto done;
-        memset(qptr->data, 0, qset * sizeof(void *));
-    }
-    q_pos = item_r / quantum;
-    r_pos = item_r % quantum;
-
-    if(!qptr->data[q_pos]) {
-        qptr->data[q_pos] = kmalloc(quantum, GFP_KERNEL);
-        if(!qptr->data[q_pos])
-            goto done;
-    }
+    if(!scull_quantum_alloc(dev, qptr, q_pos))
+        goto done;
     count = (count > quantum-r_pos)? quantum-r_pos : count;
-    if(copy_from_user(qptr->data[q_pos]+r_pos, buffer, count)) {
+    if(scull_copy_from_user(sfile, qptr->data[q_pos]+r_pos, buffer, count)) {
         retval = -EFAULT;
         goto done;
     }
 
     *f_pos += count;
+    sfile->stats.writes++;
+    sfile->stats.wbytes += count;
     retval = count;
     ALOGV("scull_write: successfully write %d to device\n", \
             retval);
@@ -462,6 +862,13 @@ int __init scull_init(void)
             scull_trim(&gSdev[index]);
             sema_init(&gSdev[index].sem, 1);
             sema_init(&gSdev[index].proc_sem, 1);
+            INIT_LIST_HEAD(&gSdev[index].appends);
+            init_waitqueue_head(&gSdev[index].append_wq);
+            if(scull_set_numa(&gSdev[index], gScull_numa_policy, gScull_numa_node)) {
+                ALOGD("scull: invalid numa policy %d on node %d, use local\n", \
+                        gScull_numa_policy, gScull_numa_node);
+                scull_set_numa(&gSdev[index], SCULL_NUMA_LOCAL, NUMA_NO_NODE);
+            }
 
             err = scull_dev_init(&gSdev[index], index);
             if(err)
@@ -469,6 +876,11 @@ int __init scull_init(void)
         }
 
         proc_create("driver/scullproc", 0, NULL, &proc_fops);
+        // a failed restore leaves the devices empty, which is not fatal
+        if(gScull_ckpt && (err = scull_restore(gScull_ckpt)) < 0) {
+            ALOGD("scull: unable to restore from %s, errno=%d\n", gScull_ckpt, err);
+            err = 0;
+        }
         ALOGD("scull module inserted to kernel!\n");
     }
 
@@ -486,7 +898,10 @@ fail:
 void __exit scull_exit(void)
 {
     int index;
-    
+
+    if(gScull_ckpt && (index = scull_checkpoint(gScull_ckpt)) < 0)
+        ALOGD("scull: unable to checkpoint to %s, errno=%d\n", gScull_ckpt, index);
+
     free_dev_num();
     for(index = 0; index < gDev_nums; ++index) {
         cdev_del(&(gSdev[index].cdev));
@@ -0,0 +1,163 @@
+/*
+ * per-op cost of the scull offset math, power-of-two geometry against the
+ * generic one
+ *
+ * without a device, time the two ways of splitting an offset alone:
+ *   ./bench_geometry
+ * with a device (needs CAP_SYS_ADMIN to set the quantum), also time small
+ * pread()s on it with quantum 4096 and then 4000:
+ *   ./bench_geometry /dev/scull0 [OPS]
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../scull_ioctl.h"
+
+#define NOFFS       (1 << 16)
+#define DEV_BYTES   (64 << 20)
+
+// the geometry is only known at run time in the driver, keep the compiler
+// from folding it into the splits here as well
+static volatile int vquantum = 4096, vqset = 1024;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * the same split as scull_split() in scull.h
+ */
+static void split_generic(int64_t pos, int quantum, int qset, \
+        int64_t *item, int *q_pos, int *r_pos)
+{
+    int32_t item_r = pos % ((int64_t)quantum * qset);
+
+    *item = pos / ((int64_t)quantum * qset);
+    *q_pos = item_r / quantum;
+    *r_pos = item_r % quantum;
+}
+
+static void split_pow2(int64_t pos, int quantum, int qset, \
+        int qshift, int sshift, int64_t *item, int *q_pos, int *r_pos)
+{
+    *item = pos >> (qshift + sshift);
+    *q_pos = (pos >> qshift) & (qset - 1);
+    *r_pos = pos & (quantum - 1);
+}
+
+/*
+ * best of a few rounds, the machine may be busy with something else
+ */
+#define ROUNDS      5
+
+static void bench_math(long ops)
+{
+    static int64_t offs[NOFFS];
+    volatile int64_t sink = 0;
+    int64_t item;
+    int q_pos, r_pos;
+    double begin, ns, generic = 1e9, pow2 = 1e9;
+    int quantum = vquantum, qset = vqset;
+    int qshift = __builtin_ctz(quantum), sshift = __builtin_ctz(qset);
+    long i;
+    int round;
+
+    srand(1);
+    for(i = 0; i < NOFFS; i++)
+        offs[i] = ((int64_t)rand() << 16) ^ rand();
+
+    for(round = 0; round < ROUNDS; round++) {
+        begin = now();
+        for(i = 0; i < ops; i++) {
+            split_generic(offs[i & (NOFFS - 1)], quantum, qset, &item, &q_pos, &r_pos);
+            sink += item + q_pos + r_pos;
+        }
+        if((ns = (now() - begin) / ops * 1e9) < generic)
+            generic = ns;
+
+        begin = now();
+        for(i = 0; i < ops; i++) {
+            split_pow2(offs[i & (NOFFS - 1)], quantum, qset, qshift, sshift, &item, &q_pos, &r_pos);
+            sink += item + q_pos + r_pos;
+        }
+        if((ns = (now() - begin) / ops * 1e9) < pow2)
+            pow2 = ns;
+    }
+
+    printf("offset math: generic %.2f ns/op, pow2 %.2f ns/op, saving %.2f ns/op\n", \
+            generic, pow2, generic - pow2);
+}
+
+/*
+ * fill the device and time small preads at random offsets, return ns/op
+ */
+static double bench_dev(int fd, long ops)
+{
+    static int64_t offs[NOFFS];
+    char buf[64];
+    double begin;
+    ssize_t n;
+    long i;
+
+    // a write stops at the end of a quantum, which 64 does not divide
+    // unless the quantum is a power of two
+    memset(buf, 'x', sizeof(buf));
+    for(i = 0; i < DEV_BYTES; i += n) {
+        if((n = pwrite(fd, buf, sizeof(buf), i)) <= 0) {
+            perror("pwrite");
+            exit(1);
+        }
+    }
+    srand(1);
+    for(i = 0; i < NOFFS; i++)
+        offs[i] = (((int64_t)rand() << 16) ^ rand()) % (DEV_BYTES - sizeof(buf));
+
+    begin = now();
+    for(i = 0; i < ops; i++) {
+        if(pread(fd, buf, 8, offs[i & (NOFFS - 1)]) < 0) {
+            perror("pread");
+            exit(1);
+        }
+    }
+    return (now() - begin) / ops * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    long ops = argc > 2 ? atol(argv[2]) : 1000000;
+    int quanta[] = { 4096, 4000 };
+    double ns[2];
+    int i, fd;
+
+    bench_math(ops * 20);
+    if(argc < 2)
+        return 0;
+
+    if((fd = open(argv[1], O_RDWR)) < 0) {
+        fprintf(stderr, "invalid driver name provided: %s\n", argv[1]);
+        exit(1);
+    }
+    for(i = 0; i < 2; i++) {
+        // setting the quantum trims the device
+        if(ioctl(fd, SCULL_IOCTQUANTUM, quanta[i]) < 0) {
+            perror("ioctl TQUANTUM");
+            exit(1);
+        }
+        ns[i] = bench_dev(fd, ops);
+        printf("device: quantum %d, %.1f ns/pread\n", quanta[i], ns[i]);
+    }
+    printf("device: saving %.1f ns/pread with pow2 geometry\n", ns[1] - ns[0]);
+    ioctl(fd, SCULL_IOCRESET);
+    close(fd);
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 #include "../scull_ioctl.h"
 
 #define PARAM2CMD(cmd)  SCULL_IOC ## #cmd
@@ -11,13 +12,20 @@ int main(int argc, char **argv)
     char *driver;
     int fd, cmdnum, cmd;
     int param, err;
+    char buf[4096];
+    struct scull_numa numa;
+    struct scull_fstats fstats;
 
     if(argc < 3) {
         printf("./a.out [DRIVER_NAME] [CMDs]:\n"
                 "CMDs:\n"
                 "\tRESET 0: to reset quantum and qset\n"
                 "\tSQUANTUM 1, SQSET 2: set thru pointer\n"
-                "\tTQUANTUM 3, TQSET 4: set thru argument value\n");
+                "\tTQUANTUM 3, TQSET 4: set thru argument value\n"
+                "\tCKPT 13, RESTORE 14: checkpoint/restore to gScull_ckpt\n"
+                "\tSNUMA 15 [POLICY] [NODE], GNUMA 16: set/get numa placement\n"
+                "\tTADVICE 17 [ADVICE]: access hint, then read the device through\n"
+                "\tGFSTATS 18: read the device and print the per file counters\n");
         return -1;
     }
 
@@ -40,6 +48,57 @@ int main(int argc, char **argv)
             }
 
             break;
+        case CKPT:
+        case RESTORE:
+            if(ioctl(fd, cmd) < 0) {
+                fprintf(stderr, "ioctl failed: %s\n", cmdnum == CKPT ? "CKPT" : "RESTORE");
+                exit(1);
+            } else {
+                printf("ioctl on %s\n", cmdnum == CKPT ? "CKPT" : "RESTORE");
+            }
+            break;
+        case SNUMA:
+        case GNUMA:
+            if(cmdnum == SNUMA) {
+                if(argc != 5) {
+                    fprintf(stderr, "policy and node should be provided!\n");
+                    exit(1);
+                }
+                numa.policy = atoi(argv[3]);
+                numa.node = atoi(argv[4]);
+            }
+            if(ioctl(fd, cmd, (void *)&numa) < 0) {
+                fprintf(stderr, "ioctl failed\n");
+                exit(1);
+            }
+            printf("numa policy %d, node %d\n", numa.policy, numa.node);
+            break;
+        case TADVICE:
+        case GFSTATS:
+            if(cmdnum == TADVICE) {
+                if(argc != 4) {
+                    fprintf(stderr, "advice should be provided!\n");
+                    exit(1);
+                }
+                if(ioctl(fd, cmd, (unsigned long) atoi(argv[3])) < 0) {
+                    fprintf(stderr, "ioctl failed\n");
+                    exit(1);
+                }
+            }
+            // the counters are per open file, so exercise this one
+            while((err = read(fd, buf, sizeof(buf))) > 0)
+                ;
+            if(ioctl(fd, scull_ioctl[GFSTATS].cmd_ioctl, (void *)&fstats) < 0) {
+                fprintf(stderr, "ioctl failed\n");
+                exit(1);
+            }
+            printf("advice %u: reads %llu (%llu bytes), writes %llu (%llu bytes), "
+                    "cached %llu, prefetched %llu, dropped %llu\n", fstats.advice, \
+                    (unsigned long long)fstats.reads, (unsigned long long)fstats.rbytes, \
+                    (unsigned long long)fstats.writes, (unsigned long long)fstats.wbytes, \
+                    (unsigned long long)fstats.cached, (unsigned long long)fstats.prefetched, \
+                    (unsigned long long)fstats.dropped);
+            break;
         case SQUANTUM:
         case SQSET:
         case TQUANTUM:
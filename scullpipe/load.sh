@@ -5,15 +5,21 @@ mode="666"
 
 /sbin/insmod ./${module}.ko $* || exit 1
 
-rm -rf /dev/${device}
+rm -rf /dev/${device} /dev/${device}[0-9]*
 
 major=$(awk -v device="$device" '$2 == device {print $1}' /proc/devices | awk 'NR == 1')
+ndevs=$(cat /sys/module/${module}/parameters/gnr_devs)
 
-mknod /dev/${device} c $major 0
+# one node per instance, /dev/scullpipe stays as the first one
+for ((i = 0; i < ndevs; i++))
+do
+	mknod /dev/${device}${i} c $major $i
+done
+ln -s /dev/${device}0 /dev/${device}
 
 group="root"
 grep -q "root" /etc/group || group="wheel"
 
-chgrp $group /dev/${device}
-chmod $mode /dev/${device}
+chgrp $group /dev/${device}[0-9]*
+chmod $mode /dev/${device}[0-9]*
 
@@ -1,31 +1,946 @@
+#include <linux/capability.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/rculist.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/uaccess.h>
 #include <linux/wait.h>
 #include "scullpipe.h"
 
+#define SCULLP_POLLIN   (EPOLLIN | EPOLLRDNORM)
+#define SCULLP_POLLOUT  (EPOLLOUT | EPOLLWRNORM)
+
+/*
+ * wake up readers (writers) sleeping in read (write) or in poll,
+ * wq_has_sleeper() carries the barrier against a task going to sleep.
+ * Blocking readers and writers wait exclusively, so only one of them is
+ * woken up here, the same holds for epoll waiters with EPOLLEXCLUSIVE.
+ */
+static void wake_readers(struct scullp_cdev *sdev)
+{
+    if(wq_has_sleeper(&sdev->inq))
+        wake_up_interruptible_poll(&sdev->inq, SCULLP_POLLIN);
+}
+
+static void wake_writers(struct scullp_cdev *sdev)
+{
+    if(wq_has_sleeper(&sdev->outq))
+        wake_up_interruptible_poll(&sdev->outq, SCULLP_POLLOUT);
+}
+
+/*
+ * SIGIO to asynchronous readers when data arrive,
+ * and to asynchronous writers when space frees
+ */
+static void signal_readers(struct scullp_cdev *sdev)
+{
+    if(sdev->async_queue)
+        kill_fasync(&sdev->async_queue, SIGIO, POLL_IN);
+}
+
+static void signal_writers(struct scullp_cdev *sdev)
+{
+    if(sdev->async_wqueue)
+        kill_fasync(&sdev->async_wqueue, SIGIO, POLL_OUT);
+}
+
+/*
+ * statistics, kept per CPU so that the data paths never share a cacheline
+ * for them; see struct scullp_stats
+ */
+static void stat_op_at(struct scullp_cdev *sdev, int dir, size_t bytes, \
+        size_t used, size_t cap)
+{
+    size_t bucket = cap ? used * SCULLP_HIST_BUCKETS / cap : 0;
+
+    this_cpu_inc(sdev->stats->ops[dir]);
+    this_cpu_add(sdev->stats->bytes[dir], bytes);
+    this_cpu_inc(sdev->stats->hist[min_t(size_t, bucket, SCULLP_HIST_BUCKETS - 1)]);
+}
+
+static void stat_op(struct scullp_cdev *sdev, int dir, size_t bytes)
+{
+    stat_op_at(sdev, dir, bytes, scullp_occupancy(sdev), scullp_capacity(sdev));
+}
+
+static void stat_short(struct scullp_cdev *sdev, int dir, bool short_op)
+{
+    if(short_op)
+        this_cpu_inc(sdev->stats->shorts[dir]);
+}
+
+static int stat_eagain(struct scullp_cdev *sdev, int dir)
+{
+    this_cpu_inc(sdev->stats->eagain[dir]);
+    return -EAGAIN;
+}
+
+static void stat_slept(struct scullp_cdev *sdev, int dir, u64 since)
+{
+    this_cpu_inc(sdev->stats->sleeps[dir]);
+    this_cpu_add(sdev->stats->wait_ns[dir], ktime_get_ns() - since);
+}
+
+/*
+ * evaluate a wait_event_*() call and account the time it took to dir
+ */
+#define scullp_timed(sdev, dir, wait) ({                \
+    u64 __since = ktime_get_ns();                       \
+    long __ret = (wait);                                \
+    stat_slept(sdev, dir, __since);                     \
+    __ret;                                              \
+})
+
+/*
+ * add up the statistics of every CPU into sum
+ */
+void scullp_stats_sum(struct scullp_cdev *sdev, struct scullp_stats *sum)
+{
+    struct scullp_stats *st;
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(sdev->stats, cpu);
+        for(i = 0; i < SCULLP_NDIR; i++) {
+            sum->ops[i] += st->ops[i];
+            sum->bytes[i] += st->bytes[i];
+            sum->sleeps[i] += st->sleeps[i];
+            sum->wait_ns[i] += st->wait_ns[i];
+            sum->eagain[i] += st->eagain[i];
+            sum->shorts[i] += st->shorts[i];
+        }
+        for(i = 0; i < SCULLP_HIST_BUCKETS; i++)
+            sum->hist[i] += st->hist[i];
+    }
+}
+
+/*
+ * rp and wp are offsets into the buffer, they rewind back to 0 when they
+ * reach bufsize. Only (bufsize-1) bytes would be available for writers, so:
+ * a) if wp==rp, this is an empty buffer;
+ * b) if rp==wp+1 (modulo bufsize), buffer is fully filled;
+ */
+static size_t ring_used(struct scullp_cdev *sdev, size_t rp, size_t wp)
+{
+    return wp >= rp ? wp - rp : wp + sdev->bufsize - rp;
+}
+
+static size_t ring_space(struct scullp_cdev *sdev, size_t rp, size_t wp)
+{
+    return sdev->bufsize - 1 - ring_used(sdev, rp, wp);
+}
+
+static size_t ring_advance(struct scullp_cdev *sdev, size_t off, size_t n)
+{
+    off += n;
+    return off >= sdev->bufsize ? off - sdev->bufsize : off;
+}
+
+/*
+ * STREAM mode with SCULLP_F_SPILL: writes the ring cannot take go to the
+ * spill store, and once anything is spilled every write goes there till
+ * reads have moved it all back into the ring, which keeps the FIFO order
+ */
+static bool spill_on(struct scullp_cdev *sdev)
+{
+    return (sdev->flags & SCULLP_F_SPILL) && sdev->mode == SCULLP_MODE_STREAM;
+}
+
+/*
+ * return currently available bufsize for writers, 0 if none is available
+ */
+size_t writerspace_avail(struct scullp_cdev *sdev)
+{
+    size_t space = ring_space(sdev, sdev->rp, sdev->wp);
+
+    if(spill_on(sdev))
+        return (sdev->spill.used ? 0 : space) + \
+            sdev->spill_max - min(sdev->spill_max, sdev->spill.used);
+    return space;
+}
+
+/*
+ * read offset of a reader: its own cursor in BCAST mode, the shared rp
+ * in other modes
+ */
+static size_t *reader_cursor(struct file *filp)
+{
+    struct scullp_file *sf = filp->private_data;
+
+    return sf->sdev->mode == SCULLP_MODE_BCAST ? &sf->rp : &sf->sdev->rp;
+}
+
+static size_t mpsc_used(struct scullp_cdev *sdev);
+
+/*
+ * return currently buffered bytes for this reader, 0 if none is left
+ */
+static size_t reader_avail(struct file *filp)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+
+    if(sdev->mode == SCULLP_MODE_MPSC)
+        return mpsc_used(sdev);
+    return ring_used(sdev, READ_ONCE(*reader_cursor(filp)), READ_ONCE(sdev->wp));
+}
+
+static size_t lane_space(struct scullp_lane *lane, size_t rp, size_t wp);
+
+static size_t writer_avail(struct file *filp)
+{
+    struct scullp_file *sf = filp->private_data;
+
+    if(sf->sdev->mode == SCULLP_MODE_MPSC)
+        return sf->lane ? lane_space(sf->lane, READ_ONCE(sf->lane->rp), READ_ONCE(sf->lane->wp)) : 0;
+    return writerspace_avail(sf->sdev);
+}
+
+/*
+ * a transfer does not block if either the file or the instance says so
+ */
+static bool scullp_nonblock(struct file *filp)
+{
+    return (filp->f_flags & O_NONBLOCK) || (scullp_dev(filp)->flags & SCULLP_F_NONBLOCK);
+}
+
+/*
+ * called after data were added: readers are only woken up (and signalled)
+ * once rx_lowat bytes are buffered, so small writes do not cost a context
+ * switch each. A flush timer bounds how long fewer bytes can sit unseen.
+ * READT callers wait for a threshold of their own, so they test it on
+ * every arrival.
+ */
+static void data_arrived(struct scullp_cdev *sdev)
+{
+    if(wq_has_sleeper(&sdev->readtq))
+        wake_up_interruptible(&sdev->readtq);
+    if(scullp_occupancy(sdev) >= sdev->rx_lowat) {
+        wake_readers(sdev);
+        signal_readers(sdev);
+    } else if(sdev->flush_usecs && !timer_pending(&sdev->flush_timer)) {
+        WRITE_ONCE(sdev->flush_due, false);
+        mod_timer(&sdev->flush_timer, jiffies + usecs_to_jiffies(sdev->flush_usecs));
+    }
+}
+
+/*
+ * called after data were consumed: writers are only woken up (and
+ * signalled) once tx_lowat bytes are free
+ */
+static void space_freed(struct scullp_cdev *sdev)
+{
+    if(writerspace_avail(sdev) >= sdev->tx_lowat) {
+        wake_writers(sdev);
+        signal_writers(sdev);
+    }
+}
+
+void scullp_flush_timeout(struct timer_list *t)
+{
+    struct scullp_cdev *sdev = from_timer(sdev, t, flush_timer);
+
+    WRITE_ONCE(sdev->flush_due, true);
+    wake_readers(sdev);
+    signal_readers(sdev);
+}
+
+/*
+ * BCAST mode: every byte is kept till the slowest reader got it, so the
+ * shared rp follows the reader lagging the most behind wp, or wp itself
+ * when nobody listens. Called with sem held.
+ */
+static void bcast_update(struct scullp_cdev *sdev)
+{
+    struct scullp_file *sf;
+    size_t used, lag = 0;
+
+    sdev->rp = sdev->wp;
+    list_for_each_entry(sf, &sdev->readers, node) {
+        used = ring_used(sdev, sf->rp, sdev->wp);
+        if(used > lag) {
+            lag = used;
+            sdev->rp = sf->rp;
+        }
+    }
+}
+
+/*
+ * BCAST mode with SCULLP_F_OVERRUN: instead of throttling the writer, the
+ * slowest readers lose what they have buffered till want bytes are free,
+ * their next read fails once with -EOVERFLOW. Called with sem held.
+ */
+static void bcast_overrun(struct scullp_cdev *sdev, size_t want)
+{
+    struct scullp_file *sf;
+
+    while(writerspace_avail(sdev) < want) {
+        list_for_each_entry(sf, &sdev->readers, node) {
+            if(sf->rp == sdev->rp) {
+                sf->rp = sdev->wp;
+                sf->overrun = true;
+            }
+        }
+        bcast_update(sdev);
+    }
+}
+
+/*
+ * buffered bytes for /proc, taken without sem; in MMAP mode the indices
+ * come from userspace and are only trusted modulo bufsize
+ */
+size_t scullp_occupancy(struct scullp_cdev *sdev)
+{
+    if(sdev->mode == SCULLP_MODE_MMAP)
+        return sdev->ctl ? ring_used(sdev, READ_ONCE(sdev->ctl->tail) % sdev->bufsize, \
+                READ_ONCE(sdev->ctl->head) % sdev->bufsize) : 0;
+    if(sdev->mode == SCULLP_MODE_MPSC)
+        return mpsc_used(sdev);
+    return ring_used(sdev, READ_ONCE(sdev->rp), READ_ONCE(sdev->wp)) + READ_ONCE(sdev->spill.used);
+}
+
+/*
+ * bytes the device can hold, the scale of the occupancy histogram
+ */
+size_t scullp_capacity(struct scullp_cdev *sdev)
+{
+    if(sdev->mode == SCULLP_MODE_MPSC)
+        return READ_ONCE(sdev->nlanes) * (sdev->lane_size - 1);
+    if(spill_on(sdev))
+        return sdev->bufsize - 1 + sdev->spill_max;
+    return sdev->bufsize - 1;
+}
+
+/*
+ * the ring is an array of single pages, so a transfer is done in segments
+ * that stop at each page boundary and at the end of the ring.
+ * ring_chunk() is the length of the segment at off
+ */
+static char *ring_addr(struct scullp_cdev *sdev, size_t off)
+{
+    return page_address(sdev->pages[off >> PAGE_SHIFT]) + offset_in_page(off);
+}
+
+static size_t ring_chunk(struct scullp_cdev *sdev, size_t off, size_t n)
+{
+    return min_t(size_t, n, min_t(size_t, PAGE_SIZE - offset_in_page(off), sdev->bufsize - off));
+}
+
+/*
+ * copy n bytes out of (into) the ring at off, return the number of bytes
+ * not copied, as copy_to_user() does
+ */
+static unsigned long ring_to_user(struct scullp_cdev *sdev, char __user *buf, size_t off, size_t n)
+{
+    size_t chunk;
+
+    while(n > 0) {
+        chunk = ring_chunk(sdev, off, n);
+        if(copy_to_user(buf, ring_addr(sdev, off), chunk))
+            return n;
+        buf += chunk;
+        n -= chunk;
+        off = ring_advance(sdev, off, chunk);
+    }
+    return 0;
+}
+
+static unsigned long ring_from_user(struct scullp_cdev *sdev, size_t off, const char __user *buf, size_t n)
+{
+    size_t chunk;
+
+    while(n > 0) {
+        chunk = ring_chunk(sdev, off, n);
+        if(copy_from_user(ring_addr(sdev, off), buf, chunk))
+            return n;
+        buf += chunk;
+        n -= chunk;
+        off = ring_advance(sdev, off, chunk);
+    }
+    return 0;
+}
+
+/*
+ * the same as above between the ring and kernel memory
+ */
+static void ring_read(struct scullp_cdev *sdev, size_t off, void *dst, size_t n)
+{
+    size_t chunk;
+
+    while(n > 0) {
+        chunk = ring_chunk(sdev, off, n);
+        memcpy(dst, ring_addr(sdev, off), chunk);
+        dst += chunk;
+        n -= chunk;
+        off = ring_advance(sdev, off, chunk);
+    }
+}
+
+static void ring_write(struct scullp_cdev *sdev, size_t off, const void *src, size_t n)
+{
+    size_t chunk;
+
+    while(n > 0) {
+        chunk = ring_chunk(sdev, off, n);
+        memcpy(ring_addr(sdev, off), src, chunk);
+        src += chunk;
+        n -= chunk;
+        off = ring_advance(sdev, off, chunk);
+    }
+}
+
+/*
+ * allocate the pages of a bufsize ring one by one, so a large ring does
+ * not depend on finding contiguous memory. bufsize is a multiple of
+ * PAGE_SIZE. Pages come from lowmem, page_address() is always valid.
+ */
+struct page **scullp_ring_alloc(size_t bufsize)
+{
+    size_t i, npages = bufsize >> PAGE_SHIFT;
+    struct page **pages;
+
+    pages = kvmalloc_array(npages, sizeof(struct page *), GFP_KERNEL | __GFP_ZERO);
+    if(!pages)
+        return NULL;
+    for(i = 0; i < npages; i++) {
+        pages[i] = alloc_page(GFP_KERNEL);
+        if(!pages[i]) {
+            scullp_ring_free(pages, bufsize);
+            return NULL;
+        }
+    }
+    return pages;
+}
+
+void scullp_ring_free(struct page **pages, size_t bufsize)
+{
+    size_t i;
+
+    if(!pages)
+        return;
+    for(i = 0; i < bufsize >> PAGE_SHIFT && pages[i]; i++)
+        __free_page(pages[i]);
+    kvfree(pages);
+}
+
+/*
+ * the spill store is a chain of qsets as in scull, each holding up to
+ * SCULLP_SPILL_QSET quanta of a page. Data are appended at wpos of the
+ * tail qset and taken at rpos of the head one; quanta and qsets are
+ * allocated on the way in and freed on the way out. Called with sem held.
+ */
+#define SPILL_QSET_BYTES    (SCULLP_SPILL_QSET * PAGE_SIZE)
+
+static void spill_free_qset(struct scullp_qset *qs)
+{
+    int i;
+
+    if(qs->data) {
+        for(i = 0; i < SCULLP_SPILL_QSET; i++)
+            kfree(qs->data[i]);
+        kfree(qs->data);
+    }
+    kfree(qs);
+}
+
+void scullp_spill_trim(struct scullp_spill *sp)
+{
+    struct scullp_qset *qs, *next;
+
+    for(qs = sp->head; qs; qs = next) {
+        next = qs->next;
+        spill_free_qset(qs);
+    }
+    memset(sp, 0, sizeof(*sp));
+}
+
+/*
+ * address of the byte at wpos of the tail qset, allocating the qset and
+ * its quantum if needed, NULL when out of memory
+ */
+static char *spill_tail(struct scullp_spill *sp)
+{
+    struct scullp_qset *qs;
+    int q;
+
+    if(!sp->tail || sp->wpos == SPILL_QSET_BYTES) {
+        qs = kzalloc(sizeof(struct scullp_qset), GFP_KERNEL);
+        if(!qs)
+            return NULL;
+        if(sp->tail)
+            sp->tail->next = qs;
+        else
+            sp->head = qs;
+        sp->tail = qs;
+        sp->wpos = 0;
+    }
+    qs = sp->tail;
+    if(!qs->data) {
+        qs->data = kcalloc(SCULLP_SPILL_QSET, sizeof(void *), GFP_KERNEL);
+        if(!qs->data)
+            return NULL;
+    }
+    q = sp->wpos / PAGE_SIZE;
+    if(!qs->data[q]) {
+        qs->data[q] = kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if(!qs->data[q])
+            return NULL;
+    }
+    return (char *)qs->data[q] + sp->wpos % PAGE_SIZE;
+}
+
+/*
+ * append up to n bytes of buf to the spill store, return the number of
+ * bytes stored or an error if none could be
+ */
+static ssize_t spill_from_user(struct scullp_cdev *sdev, const char __user *buf, size_t n)
+{
+    struct scullp_spill *sp = &sdev->spill;
+    size_t done = 0, chunk;
+    char *dst;
+
+    while(done < n) {
+        if(!(dst = spill_tail(sp)))
+            return done ? done : -ENOMEM;
+        chunk = min_t(size_t, n - done, PAGE_SIZE - sp->wpos % PAGE_SIZE);
+        if(copy_from_user(dst, buf + done, chunk))
+            return done ? done : -EFAULT;
+        sp->wpos += chunk;
+        sp->used += chunk;
+        done += chunk;
+    }
+    return done;
+}
+
+/*
+ * move spilled data into the free space of the ring, oldest first
+ */
+static void spill_to_ring(struct scullp_cdev *sdev)
+{
+    struct scullp_spill *sp = &sdev->spill;
+    struct scullp_qset *next;
+    size_t n = min(sp->used, ring_space(sdev, sdev->rp, sdev->wp)), chunk;
+    int q;
+
+    while(n > 0) {
+        q = sp->rpos / PAGE_SIZE;
+        chunk = min_t(size_t, n, PAGE_SIZE - sp->rpos % PAGE_SIZE);
+        ring_write(sdev, sdev->wp, (char *)sp->head->data[q] + sp->rpos % PAGE_SIZE, chunk);
+        sdev->wp = ring_advance(sdev, sdev->wp, chunk);
+        sp->rpos += chunk;
+        sp->used -= chunk;
+        n -= chunk;
+        // a quantum read to its end is not written anymore
+        if(sp->rpos % PAGE_SIZE == 0) {
+            kfree(sp->head->data[q]);
+            sp->head->data[q] = NULL;
+        }
+        if(sp->rpos == SPILL_QSET_BYTES) {
+            next = sp->head->next;
+            spill_free_qset(sp->head);
+            sp->head = next;
+            sp->rpos = 0;
+            if(!next)
+                sp->tail = NULL;
+        }
+    }
+    if(!sp->used)
+        scullp_spill_trim(sp);
+}
+
+/*
+ * bytes a transfer of count waits for before it goes on: any byte by
+ * default, the whole count (capped at the ring capacity) in wait-all mode
+ */
+static size_t ring_want(struct scullp_cdev *sdev, size_t count)
+{
+    if(!(sdev->flags & SCULLP_F_WAITALL))
+        return 1;
+    return min(count, sdev->bufsize - 1);
+}
+
+/*
+ * SPSC mode: the reader owns rp and the writer owns wp, so no lock is taken.
+ * Each side publishes its own offset with a release store after the copy and
+ * picks up the other one with an acquire load, which orders the data copy
+ * against the offset update on both sides.
+ */
+static ssize_t spsc_read(struct file* filp, char __user *buf, size_t count, bool nonblock)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    size_t rp = READ_ONCE(sdev->rp), want = ring_want(sdev, count), avail;
+
+    while((avail = ring_used(sdev, rp, smp_load_acquire(&sdev->wp))) < want) {
+        if(nonblock) {
+            if(avail)
+                break;
+            return stat_eagain(sdev, SCULLP_RD);
+        }
+        if(scullp_timed(sdev, SCULLP_RD, wait_event_interruptible(sdev->inq, \
+                    ring_used(sdev, rp, smp_load_acquire(&sdev->wp)) >= want)))
+            return -ERESTARTSYS;
+    }
+    stat_short(sdev, SCULLP_RD, avail < count);
+    count = min(count, avail);
+
+    if(ring_to_user(sdev, buf, rp, count))
+        return -EFAULT;
+    smp_store_release(&sdev->rp, ring_advance(sdev, rp, count));
+    stat_op(sdev, SCULLP_RD, count);
+
+    space_freed(sdev);
+    return count;
+}
+
+static ssize_t spsc_write(struct file* filp, const char __user *buf, size_t count)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    size_t wp = READ_ONCE(sdev->wp), want = ring_want(sdev, count), avail;
+
+    while((avail = ring_space(sdev, smp_load_acquire(&sdev->rp), wp)) < want) {
+        if(scullp_nonblock(filp)) {
+            if(avail)
+                break;
+            return stat_eagain(sdev, SCULLP_WR);
+        }
+        if(scullp_timed(sdev, SCULLP_WR, wait_event_interruptible(sdev->outq, \
+                    ring_space(sdev, smp_load_acquire(&sdev->rp), wp) >= want)))
+            return -ERESTARTSYS;
+    }
+    stat_short(sdev, SCULLP_WR, avail < count);
+    count = min(count, avail);
+
+    if(ring_from_user(sdev, wp, buf, count))
+        return -EFAULT;
+    smp_store_release(&sdev->wp, ring_advance(sdev, wp, count));
+    stat_op(sdev, SCULLP_WR, count);
+
+    data_arrived(sdev);
+    return count;
+}
+
+/*
+ * sleep on q till avail() reaches want, called with sem held and returns
+ * with sem held on success. Sleepers are exclusive unless they want more
+ * than a byte (wait-all mode, PACKET writers), as a woken task may not find
+ * enough to go on and would eat the wakeup, or unless they are BCAST
+ * readers, which all want every byte.
+ */
+static int stream_wait(struct file *filp, wait_queue_head_t *q, \
+        size_t (*avail)(struct file *), size_t want, void (*wake)(struct scullp_cdev *))
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    wait_queue_entry_t wait;
+    u64 since;
+
+    // unlock to let the other side in
+    up(&sdev->sem);
+    init_wait(&wait);
+    if(want > 1 || (sdev->mode == SCULLP_MODE_BCAST && q == &sdev->inq))
+        prepare_to_wait(q, &wait, TASK_INTERRUPTIBLE);
+    else
+        prepare_to_wait_exclusive(q, &wait, TASK_INTERRUPTIBLE);
+    if(avail(filp) < want) {
+        since = ktime_get_ns();
+        schedule();
+        stat_slept(sdev, q == &sdev->inq ? SCULLP_RD : SCULLP_WR, since);
+    }
+    finish_wait(q, &wait);
+    if(signal_pending(current)) {
+        // we may have eaten an exclusive wakeup, pass it on
+        wake(sdev);
+        return -ERESTARTSYS;
+    }
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/*
+ * STREAM and BCAST modes, serialised on sem
+ */
+static ssize_t stream_read(struct file* filp, char __user *buf, size_t count, bool nonblock)
+{
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+    size_t want = ring_want(sdev, count), avail, *rp;
+    ssize_t err;
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    if(sf->overrun) {
+        sf->overrun = false;
+        up(&sdev->sem);
+        return -EOVERFLOW;
+    }
+
+    // wait till writer fill data to buffer
+    while((avail = reader_avail(filp)) < want) {
+        if(nonblock) {
+            if(avail)
+                break;
+            up(&sdev->sem);
+            return stat_eagain(sdev, SCULLP_RD);
+        }
+        ALOGV("%s: proc reading is going to sleep...", current->comm);
+        if(stream_wait(filp, &sdev->inq, reader_avail, want, wake_readers))
+            return -ERESTARTSYS;
+        // the ring or the flags may have changed meanwhile
+        want = ring_want(sdev, count);
+    }
+    stat_short(sdev, SCULLP_RD, avail < count);
+    count = min(count, avail);
+    ALOGV("reading: now we have %lu bytes buffer available to read", avail);
+
+    rp = reader_cursor(filp);
+    if(ring_to_user(sdev, buf, *rp, count)) {
+        err = -EFAULT;
+        goto done;
+    }
+    *rp = ring_advance(sdev, *rp, count);
+    if(sdev->mode == SCULLP_MODE_BCAST)
+        bcast_update(sdev);
+    if(sdev->spill.used)
+        spill_to_ring(sdev);
+    stat_op(sdev, SCULLP_RD, count);
+    err = count;
+    ALOGV("%s: did read %zu bytes", current->comm, count);
+    // wake up sleeping writers, and the next reader if data are left
+    space_freed(sdev);
+    if(sdev->mode != SCULLP_MODE_BCAST && sdev->rp != sdev->wp)
+        wake_readers(sdev);
+
+done:
+    up(&sdev->sem);
+    return err;
+}
+
+static ssize_t stream_write(struct file* filp, const char __user *buf, size_t count)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    size_t want = ring_want(sdev, count), avail, ring_n;
+    ssize_t err, spilled;
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+
+    if(sdev->mode == SCULLP_MODE_BCAST && (sdev->flags & SCULLP_F_OVERRUN))
+        bcast_overrun(sdev, want);
+    while((avail = writerspace_avail(sdev)) < want) {
+        if(scullp_nonblock(filp)) {
+            if(avail)
+                break;
+            up(&sdev->sem);
+            return stat_eagain(sdev, SCULLP_WR);
+        }
+        ALOGV("%s: proc writing is going to sleep...", current->comm);
+        if(stream_wait(filp, &sdev->outq, writer_avail, want, wake_writers))
+            return -ERESTARTSYS;
+        want = ring_want(sdev, count);
+    }
+    stat_short(sdev, SCULLP_WR, avail < count);
+    count = min(count, avail);
+    ALOGV("writing: now we have %lu bytes of free space to write", avail);
+
+    ring_n = count;
+    if(spill_on(sdev))
+        ring_n = sdev->spill.used ? 0 : min(count, ring_space(sdev, sdev->rp, sdev->wp));
+    if(ring_from_user(sdev, sdev->wp, buf, ring_n)) {
+        err = -EFAULT;
+        goto done;
+    }
+    sdev->wp = ring_advance(sdev, sdev->wp, ring_n);
+    if(ring_n < count) {
+        spilled = spill_from_user(sdev, buf + ring_n, count - ring_n);
+        if(spilled < 0 && !ring_n) {
+            err = spilled;
+            goto done;
+        }
+        count = ring_n + max_t(ssize_t, spilled, 0);
+    }
+    // with no BCAST reader around, nobody holds the data back
+    if(sdev->mode == SCULLP_MODE_BCAST && list_empty(&sdev->readers))
+        sdev->rp = sdev->wp;
+    stat_op(sdev, SCULLP_WR, count);
+    err = count;
+    ALOGV("%s: did write %zu bytes", current->comm, count);
+
+    data_arrived(sdev);
+    if(writerspace_avail(sdev))
+        wake_writers(sdev);
+
+done:
+    up(&sdev->sem);
+    return err;
+}
+
+/*
+ * PACKET mode: each write() is stored whole as one record, a u32 length
+ * followed by the payload, or not at all; each read() takes one record.
+ * Serialised on sem like STREAM mode.
+ */
+
+/*
+ * dequeue the record at rp into buf and its length into *lenp if given,
+ * called with sem held and a record buffered. Nothing is consumed on error,
+ * a record larger than count stays in place with -EMSGSIZE
+ */
+static ssize_t packet_pop(struct scullp_cdev *sdev, char __user *buf, size_t count, u32 __user *lenp)
+{
+    u32 len;
+
+    ring_read(sdev, sdev->rp, &len, sizeof(len));
+    if(len > count)
+        return -EMSGSIZE;
+    if(lenp && put_user(len, lenp))
+        return -EFAULT;
+    if(ring_to_user(sdev, buf, ring_advance(sdev, sdev->rp, sizeof(len)), len))
+        return -EFAULT;
+    sdev->rp = ring_advance(sdev, sdev->rp, sizeof(len) + len);
+    stat_op(sdev, SCULLP_RD, len);
+    return len;
+}
+
+/*
+ * wait till a record is buffered, called with sem held, returns with sem
+ * held on success and released on failure
+ */
+static int packet_wait(struct file *filp)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+
+    while(reader_avail(filp) == 0) {
+        if(scullp_nonblock(filp)) {
+            up(&sdev->sem);
+            return stat_eagain(sdev, SCULLP_RD);
+        }
+        if(stream_wait(filp, &sdev->inq, reader_avail, 1, wake_readers))
+            return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static void packet_popped(struct scullp_cdev *sdev)
+{
+    space_freed(sdev);
+    if(sdev->rp != sdev->wp)
+        wake_readers(sdev);
+}
+
+static ssize_t packet_read(struct file* filp, char __user *buf, size_t count)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    ssize_t err;
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    if((err = packet_wait(filp)))
+        return err;
+
+    err = packet_pop(sdev, buf, count, NULL);
+    if(err >= 0)
+        packet_popped(sdev);
+    up(&sdev->sem);
+    return err;
+}
+
+static ssize_t packet_write(struct file* filp, const char __user *buf, size_t count)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    size_t need = sizeof(u32) + count;
+    u32 len = count;
+    ssize_t err;
+
+    if(count == 0)
+        return 0;
+    if(count > U32_MAX || need > sdev->bufsize - 1)
+        return -EMSGSIZE;
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    while(writerspace_avail(sdev) < need) {
+        // the ring may have shrunk below the record while we slept
+        if(need > sdev->bufsize - 1) {
+            up(&sdev->sem);
+            return -EMSGSIZE;
+        }
+        if(scullp_nonblock(filp)) {
+            up(&sdev->sem);
+            return stat_eagain(sdev, SCULLP_WR);
+        }
+        if(stream_wait(filp, &sdev->outq, writer_avail, need, wake_writers))
+            return -ERESTARTSYS;
+    }
+
+    // payload first, the record only shows up once wp moves past it
+    if(ring_from_user(sdev, ring_advance(sdev, sdev->wp, sizeof(len)), buf, count)) {
+        err = -EFAULT;
+        goto done;
+    }
+    ring_write(sdev, sdev->wp, &len, sizeof(len));
+    sdev->wp = ring_advance(sdev, sdev->wp, need);
+    stat_op(sdev, SCULLP_WR, count);
+    err = count;
+
+    data_arrived(sdev);
+    if(writerspace_avail(sdev))
+        wake_writers(sdev);
+
+done:
+    up(&sdev->sem);
+    return err;
+}
+
 /*
- * return currently availble bufsize for writers
- * 0 if non is available
- *
- * Reading and writing ptr would rewound back to beginning if it reaches the end,
- * only (bufsize-1) space would be available for writer, so:
- * a) if wp==rp, this is an empty buffer;
- * b) if rp=wp+1, buffer is fully filled;
- *
- * so return value would be as follow:
- * 1) if wp >= rp, return min(rp+bufsize-wp-1, buf_end-wp)
- * 2) if rp > wp, return rp-wp-1;
- *
+ * dequeue up to nrec records in one call, packed back to back in buf with
+ * their lengths in lens. Block till one record is there, then take every
+ * buffered record that fits. Return the number of records.
  */
-size_t writerspace_avail(struct scullp_cdev *sdev)
+static long packet_recvv(struct file *filp, struct scullp_recvv __user *uarg)
 {
-    if(sdev->wp >= sdev->rp)
-        return min(sdev->rp + sdev->bufsize - sdev->wp - 1, sdev->buf_end - sdev->wp);
-    else
-        return (sdev->rp - sdev->wp - 1);
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    struct scullp_recvv rv;
+    char __user *buf;
+    u32 __user *lens;
+    size_t off = 0;
+    ssize_t len = 0;
+    long n = 0;
+
+    // dequeuing is reading, like read() it needs a file open for it
+    if(!(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if(sdev->mode != SCULLP_MODE_PACKET)
+        return -EINVAL;
+    if(copy_from_user(&rv, uarg, sizeof(rv)))
+        return -EFAULT;
+    if(rv.nrec == 0)
+        return 0;
+    buf = u64_to_user_ptr(rv.buf);
+    lens = u64_to_user_ptr(rv.lens);
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    if((len = packet_wait(filp)))
+        return len;
+
+    while(n < rv.nrec && sdev->rp != sdev->wp) {
+        len = packet_pop(sdev, buf + off, rv.buflen - off, lens + n);
+        if(len < 0)
+            break;
+        off += len;
+        n++;
+    }
+    if(n)
+        packet_popped(sdev);
+    up(&sdev->sem);
+    return n ? n : len;
 }
 
 loff_t scullp_llseek(struct file* filp, loff_t loff, int whence)
@@ -33,143 +948,883 @@ loff_t scullp_llseek(struct file* filp, loff_t loff, int whence)
     return 0;
 }
 
-ssize_t scullp_read(struct file* filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * MPSC mode: writers only take the lock of their own lane and store to
+ * nothing but it, so producers on different files never contend; the
+ * device holds what all lanes hold, summed up by whoever asks. Each lane
+ * keeps the order of its producer; across lanes a reader drains, round
+ * robin, what each lane held when it got there before moving on, so a
+ * busy producer cannot starve the others.
+ */
+static size_t lane_used(struct scullp_lane *lane, size_t rp, size_t wp)
 {
-    struct scullp_cdev *sdev = filp->private_data;
-    ssize_t rcount;
-    int err;
-    wait_queue_entry_t read_wait;
+    return wp >= rp ? wp - rp : wp + lane->size - rp;
+}
 
-    if(down_interruptible(&sdev->sem))
+static size_t lane_space(struct scullp_lane *lane, size_t rp, size_t wp)
+{
+    return lane->size - 1 - lane_used(lane, rp, wp);
+}
+
+static size_t lane_advance(struct scullp_lane *lane, size_t off, size_t n)
+{
+    off += n;
+    return off >= lane->size ? off - lane->size : off;
+}
+
+static size_t mpsc_used(struct scullp_cdev *sdev)
+{
+    struct scullp_lane *lane;
+    size_t used = 0;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(lane, &sdev->lanes, node)
+        used += lane_used(lane, READ_ONCE(lane->rp), smp_load_acquire(&lane->wp));
+    rcu_read_unlock();
+    return used;
+}
+
+static struct scullp_lane *lane_alloc(size_t size)
+{
+    struct scullp_lane *lane;
+
+    lane = kzalloc(sizeof(struct scullp_lane), GFP_KERNEL);
+    if(!lane)
+        return NULL;
+    lane->buf = kvmalloc(size, GFP_KERNEL);
+    if(!lane->buf) {
+        kfree(lane);
+        return NULL;
+    }
+    lane->size = size;
+    mutex_init(&lane->lock);
+    init_waitqueue_head(&lane->wq);
+    INIT_LIST_HEAD(&lane->node);
+    return lane;
+}
+
+static void lane_add(struct scullp_cdev *sdev, struct scullp_lane *lane)
+{
+    list_add_tail_rcu(&lane->node, &sdev->lanes);
+    sdev->nlanes++;
+}
+
+/*
+ * unlink and free a lane, called with sem held. Its indices may still be
+ * read by mpsc_used(), its buffer is not
+ */
+static void lane_free(struct scullp_cdev *sdev, struct scullp_lane *lane)
+{
+    if(sdev->cur_lane == lane)
+        sdev->cur_lane = NULL;
+    list_del_rcu(&lane->node);
+    sdev->nlanes--;
+    kvfree(lane->buf);
+    kfree_rcu(lane, rcu);
+}
+
+/*
+ * free every lane of sdev, staged data are dropped. Called with sem held
+ * or once nobody can open the device anymore
+ */
+void scullp_lanes_free(struct scullp_cdev *sdev)
+{
+    struct scullp_lane *lane, *tmp;
+
+    list_for_each_entry_safe(lane, tmp, &sdev->lanes, node)
+        lane_free(sdev, lane);
+}
+
+static ssize_t mpsc_write(struct file* filp, const char __user *buf, size_t count)
+{
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+    struct scullp_lane *lane = sf->lane;
+    size_t wp, want, avail, first;
+
+    if(!lane)
+        return -EINVAL;
+    if(mutex_lock_interruptible(&lane->lock))
         return -ERESTARTSYS;
 
-    // wait till writer fill data to buffer
-    while(sdev->rp == sdev->wp) {
-        // unlock to let writer in
-        up(&sdev->sem);
-        if(filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-        init_wait(&read_wait);
-        ALOGD("%s: proc reading is going to sleep...", current->comm);
-        prepare_to_wait(&sdev->inq, &read_wait, TASK_INTERRUPTIBLE);
-
-        if(sdev->rp == sdev->wp)
-            schedule();
-        finish_wait(&sdev->inq, &read_wait);
-        if(signal_pending(current))
+    wp = lane->wp;
+    want = (sdev->flags & SCULLP_F_WAITALL) ? min(count, lane->size - 1) : 1;
+    while((avail = lane_space(lane, smp_load_acquire(&lane->rp), wp)) < want) {
+        if(scullp_nonblock(filp)) {
+            if(avail)
+                break;
+            mutex_unlock(&lane->lock);
+            return stat_eagain(sdev, SCULLP_WR);
+        }
+        if(scullp_timed(sdev, SCULLP_WR, wait_event_interruptible(lane->wq, \
+                    lane_space(lane, smp_load_acquire(&lane->rp), wp) >= want))) {
+            mutex_unlock(&lane->lock);
             return -ERESTARTSYS;
-        if(down_interruptible(&sdev->sem))
+        }
+    }
+    stat_short(sdev, SCULLP_WR, avail < count);
+    count = min(count, avail);
+
+    first = min(count, lane->size - wp);
+    if(copy_from_user(lane->buf + wp, buf, first) || \
+            copy_from_user(lane->buf, buf + first, count - first)) {
+        mutex_unlock(&lane->lock);
+        return -EFAULT;
+    }
+    wp = lane_advance(lane, wp, count);
+    smp_store_release(&lane->wp, wp);
+    mutex_unlock(&lane->lock);
+    // the writer sees its own lane, summing them all would read the others
+    stat_op_at(sdev, SCULLP_WR, count, lane_used(lane, READ_ONCE(lane->rp), wp), lane->size - 1);
+
+    // pairs with the barrier of a reader going to sleep: either it sees wp
+    // or we see it waiting. With nobody waiting, poll() arms the flush timer
+    smp_mb();
+    if(waitqueue_active(&sdev->inq) || waitqueue_active(&sdev->readtq) || \
+            READ_ONCE(sdev->async_queue))
+        data_arrived(sdev);
+    return count;
+}
+
+/*
+ * copy what lane holds, up to count bytes, to buf. Called with sem held,
+ * *drained tells whether the lane had nothing more than that
+ */
+static ssize_t lane_drain(struct scullp_cdev *sdev, struct scullp_lane *lane, \
+        char __user *buf, size_t count, bool *drained)
+{
+    size_t rp = lane->rp, avail, first;
+
+    avail = lane_used(lane, rp, smp_load_acquire(&lane->wp));
+    *drained = count >= avail;
+    count = min(count, avail);
+    if(!count)
+        return 0;
+
+    first = min(count, lane->size - rp);
+    if(copy_to_user(buf, lane->buf + rp, first) || \
+            copy_to_user(buf + first, lane->buf, count - first))
+        return -EFAULT;
+    rp = lane_advance(lane, rp, count);
+    smp_store_release(&lane->rp, rp);
+
+    // blocked writers sleep on the lane, pollers on outq, which outlives it
+    if(lane_space(lane, rp, READ_ONCE(lane->wp)) >= min(sdev->tx_lowat, lane->size - 1)) {
+        if(wq_has_sleeper(&lane->wq))
+            wake_up_interruptible_poll(&lane->wq, SCULLP_POLLOUT);
+        wake_writers(sdev);
+        signal_writers(sdev);
+    }
+    return count;
+}
+
+static ssize_t mpsc_read(struct file* filp, char __user *buf, size_t count, bool nonblock)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    struct scullp_lane *lane, *next;
+    size_t done = 0;
+    ssize_t n = 0;
+    bool drained;
+    int visited;
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    while(reader_avail(filp) == 0) {
+        if(nonblock) {
+            up(&sdev->sem);
+            return stat_eagain(sdev, SCULLP_RD);
+        }
+        if(stream_wait(filp, &sdev->inq, reader_avail, 1, wake_readers))
             return -ERESTARTSYS;
     }
-    if(sdev->wp > sdev->rp)
-        rcount = min(count, (size_t)(sdev->wp - sdev->rp));
-    else
-        rcount = min(count, (size_t)(sdev->buf_end - sdev->rp));
-    ALOGV("reading: now we have %lu bytes buffer available to read", rcount);
 
-    if(copy_to_user(buf, sdev->rp, rcount)) {
-        err = -EFAULT;
-        goto done;
+    lane = sdev->cur_lane;
+    if(!lane && !list_empty(&sdev->lanes))
+        lane = list_first_entry(&sdev->lanes, struct scullp_lane, node);
+    for(visited = 0; lane && done < count && visited < sdev->nlanes; ) {
+        n = lane_drain(sdev, lane, buf + done, count - done, &drained);
+        if(n < 0)
+            break;
+        done += n;
+        if(!drained)
+            break;
+        // this lane is done for now, go on with the next one
+        next = list_is_last(&lane->node, &sdev->lanes) ? \
+            list_first_entry(&sdev->lanes, struct scullp_lane, node) : list_next_entry(lane, node);
+        if(lane->orphan && !lane_used(lane, lane->rp, lane->wp)) {
+            if(next == lane)
+                next = NULL;
+            lane_free(sdev, lane);
+        } else {
+            visited++;
+        }
+        lane = next;
     }
-    sdev->rp += rcount;
-    // wrap reader ptr back to the beginning
-    if(sdev->rp == sdev->buf_end)
-        sdev->rp = sdev->buf_begin;
-    err = rcount;
-    *f_pos += rcount;
-    ALOGD("%s: did read %li bytes", current->comm, rcount);
-    // wake up sleeping writers
-    wake_up_interruptible(&sdev->outq);
+    sdev->cur_lane = lane;
 
-done:
+    stat_short(sdev, SCULLP_RD, done < count);
+    stat_op(sdev, SCULLP_RD, done);
+    if(reader_avail(filp))
+        wake_readers(sdev);
     up(&sdev->sem);
-    return err;
+    return done ? done : n;
+}
+
+/*
+ * READT: wait with an hrtimer backed timeout till min_bytes are buffered
+ * for this reader, then take up to count bytes without blocking, however
+ * many arrived. -ETIMEDOUT if nothing did. The wait is on readtq, woken on
+ * every arrival, so min_bytes below rx_lowat is honoured as well.
+ */
+static long scullp_readt(struct file *filp, struct scullp_readt __user *arg)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    struct scullp_readt rt;
+    char __user *buf;
+    size_t want;
+    ktime_t timeout;
+    ssize_t ret;
+
+    // it consumes data like read(), and only readers have a BCAST cursor
+    if(!(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if(copy_from_user(&rt, arg, sizeof(rt)))
+        return -EFAULT;
+    if(sdev->mode != SCULLP_MODE_STREAM && sdev->mode != SCULLP_MODE_SPSC && \
+            sdev->mode != SCULLP_MODE_BCAST && sdev->mode != SCULLP_MODE_MPSC)
+        return -EINVAL;
+    if(rt.count == 0)
+        return 0;
+    buf = u64_to_user_ptr(rt.buf);
+    // more than the device can hold would only ever time out; an MPSC
+    // device without writers holds nothing yet, wait for a byte there
+    want = clamp_t(u64, rt.min_bytes, 1, min_t(u64, rt.count, max_t(size_t, scullp_capacity(sdev), 1)));
+    timeout = ns_to_ktime(min_t(u64, rt.timeout_us, KTIME_MAX / NSEC_PER_USEC) * NSEC_PER_USEC);
+
+    if(reader_avail(filp) < want) {
+        ret = scullp_timed(sdev, SCULLP_RD, \
+                wait_event_interruptible_hrtimeout(sdev->readtq, reader_avail(filp) >= want, timeout));
+        if(ret == -ERESTARTSYS)
+            return ret;
+    }
+
+    switch(sdev->mode) {
+        case SCULLP_MODE_SPSC:
+            ret = spsc_read(filp, buf, rt.count, true);
+            break;
+        case SCULLP_MODE_MPSC:
+            ret = mpsc_read(filp, buf, rt.count, true);
+            break;
+        default:
+            ret = stream_read(filp, buf, rt.count, true);
+            break;
+    }
+    return ret == -EAGAIN ? -ETIMEDOUT : ret;
+}
+
+/*
+ * read and write go thru the data path of the device mode; in wait-all
+ * mode a request larger than the ring is served in several passes, except
+ * in PACKET mode where a call always moves a single record
+ */
+ssize_t scullp_read(struct file* filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    size_t done = 0;
+    ssize_t rcount;
+
+    do {
+        switch(sdev->mode) {
+            case SCULLP_MODE_SPSC:
+                rcount = spsc_read(filp, buf + done, count - done, scullp_nonblock(filp));
+                break;
+            case SCULLP_MODE_MMAP:
+                rcount = -EINVAL;
+                break;
+            case SCULLP_MODE_PACKET:
+                return packet_read(filp, buf, count);
+            case SCULLP_MODE_MPSC:
+                rcount = mpsc_read(filp, buf + done, count - done, scullp_nonblock(filp));
+                break;
+            default:
+                rcount = stream_read(filp, buf + done, count - done, scullp_nonblock(filp));
+                break;
+        }
+        if(rcount < 0)
+            return done ? done : rcount;
+        done += rcount;
+        *f_pos += rcount;
+    } while((sdev->flags & SCULLP_F_WAITALL) && done < count && \
+            !scullp_nonblock(filp));
+
+    return done;
 }
 
 ssize_t scullp_write(struct file* filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    // write method should not wrap write ptr when it reaches the end,
-    // otherwise, writing a full-size buffer would be taken as empty buffer
-    struct scullp_cdev *sdev = filp->private_data;
-    size_t wcount;
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    size_t done = 0;
+    ssize_t wcount;
+
+    do {
+        switch(sdev->mode) {
+            case SCULLP_MODE_SPSC:
+                wcount = spsc_write(filp, buf + done, count - done);
+                break;
+            case SCULLP_MODE_MMAP:
+                wcount = -EINVAL;
+                break;
+            case SCULLP_MODE_PACKET:
+                return packet_write(filp, buf, count);
+            case SCULLP_MODE_MPSC:
+                wcount = mpsc_write(filp, buf + done, count - done);
+                break;
+            default:
+                wcount = stream_write(filp, buf + done, count - done);
+                break;
+        }
+        if(wcount < 0)
+            return done ? done : wcount;
+        done += wcount;
+        *f_pos += wcount;
+    } while((sdev->flags & SCULLP_F_WAITALL) && done < count && \
+            !scullp_nonblock(filp));
+
+    return done;
+}
+
+/*
+ * MMAP mode: head and tail live in the control page and may be scribbled
+ * by userspace, so only sdev->bufsize is trusted for the ring size. The
+ * kernel never touches the ring data, so a bogus index costs nothing more
+ * than a wrong answer to the user who wrote it.
+ */
+static bool ring_ctl_readable(struct scullp_cdev *sdev)
+{
+    return READ_ONCE(sdev->ctl->head) != READ_ONCE(sdev->ctl->tail);
+}
+
+static bool ring_ctl_writable(struct scullp_cdev *sdev)
+{
+    return (READ_ONCE(sdev->ctl->head) + 1) % sdev->bufsize != READ_ONCE(sdev->ctl->tail);
+}
+
+/*
+ * announce a sleeper thru the control page, then test the ring again:
+ * the full barrier pairs with the one userspace puts between publishing
+ * head (tail) and testing rwaiting (wwaiting)
+ */
+static bool ring_ctl_ready(struct scullp_cdev *sdev, bool rd)
+{
+    WRITE_ONCE(*(rd ? &sdev->ctl->rwaiting : &sdev->ctl->wwaiting), 1);
+    smp_mb();
+    return rd ? ring_ctl_readable(sdev) : ring_ctl_writable(sdev);
+}
+
+static long ring_ctl_wait(struct file *filp, bool rd)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    long err;
+
+    if(rd ? ring_ctl_readable(sdev) : ring_ctl_writable(sdev))
+        return 0;
+    if(scullp_nonblock(filp))
+        return stat_eagain(sdev, rd ? SCULLP_RD : SCULLP_WR);
+
+    if(rd)
+        err = scullp_timed(sdev, SCULLP_RD, \
+                wait_event_interruptible_exclusive(sdev->inq, ring_ctl_ready(sdev, true)));
+    else
+        err = scullp_timed(sdev, SCULLP_WR, \
+                wait_event_interruptible_exclusive(sdev->outq, ring_ctl_ready(sdev, false)));
+    WRITE_ONCE(*(rd ? &sdev->ctl->rwaiting : &sdev->ctl->wwaiting), 0);
+    return err;
+}
+
+/*
+ * a poller only counts as waiting while the ring is not ready: the flag
+ * is dropped again as soon as poll reports it, or the other side would
+ * go on issuing wakeups for nobody
+ */
+static bool ring_ctl_poll_ready(struct scullp_cdev *sdev, bool rd)
+{
+    if(!ring_ctl_ready(sdev, rd))
+        return false;
+    WRITE_ONCE(*(rd ? &sdev->ctl->rwaiting : &sdev->ctl->wwaiting), 0);
+    return true;
+}
+
+static __poll_t ring_ctl_poll(struct file *filp)
+{
+    struct scullp_file *sf = filp->private_data;
+    __poll_t mask = 0;
+
+    if(sf->role == SCULLP_ROLE_CONSUMER && ring_ctl_poll_ready(sf->sdev, true))
+        mask |= SCULLP_POLLIN;
+    if(sf->role == SCULLP_ROLE_PRODUCER && ring_ctl_poll_ready(sf->sdev, false))
+        mask |= SCULLP_POLLOUT;
+    return mask;
+}
+
+/*
+ * take the consumer or the producer side of the MMAP ring for filp,
+ * which must be open for both reading and writing to map it shared
+ */
+static long ring_ctl_claim(struct file *filp, unsigned long role)
+{
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+    long err = 0;
+
+    if(role != SCULLP_ROLE_CONSUMER && role != SCULLP_ROLE_PRODUCER)
+        return -EINVAL;
+    if((filp->f_mode & (FMODE_READ | FMODE_WRITE)) != (FMODE_READ | FMODE_WRITE))
+        return -EBADF;
+
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    if(sdev->mode != SCULLP_MODE_MMAP)
+        err = -EINVAL;
+    else if(sf->role)
+        err = sf->role == role ? 0 : -EINVAL;
+    else if(sdev->ring_roles & (1 << role))
+        err = -EBUSY;
+    else {
+        sdev->ring_roles |= 1 << role;
+        sf->role = role;
+    }
+    up(&sdev->sem);
+    return err;
+}
+
+/*
+ * map the control page and then the ring data, see scullp_ioctl.h,
+ * mapping the control page alone lets userspace learn the ring size
+ */
+int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    unsigned long i, size = vma->vm_end - vma->vm_start;
     int err;
-    wait_queue_entry_t write_wait;
 
+    if(sdev->mode != SCULLP_MODE_MMAP)
+        return -EINVAL;
+    if(vma->vm_pgoff != 0 || (size != PAGE_SIZE && size != PAGE_SIZE + sdev->bufsize))
+        return -EINVAL;
+
+    // the ring pages are not contiguous, they are inserted one by one
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    err = vm_insert_page(vma, vma->vm_start, virt_to_page(sdev->ctl));
+    for(i = 0; !err && i < (size - PAGE_SIZE) >> PAGE_SHIFT; i++)
+        err = vm_insert_page(vma, vma->vm_start + ((i + 1) << PAGE_SHIFT), sdev->pages[i]);
+    return err;
+}
+
+/*
+ * the snapshot of rp and wp is taken without sem, which is fine for poll:
+ * any later change of either offset comes with a wakeup on inq or outq
+ */
+__poll_t scullp_poll(struct file *filp, poll_table *wait)
+{
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+    __poll_t mask = 0;
+    size_t avail;
+
+    poll_wait(filp, &sdev->inq, wait);
+    poll_wait(filp, &sdev->outq, wait);
+
+    if(sdev->mode == SCULLP_MODE_MMAP)
+        return ring_ctl_poll(filp);
+
+    // MPSC writers only look for sleepers after adding data, see mpsc_write()
+    if(sdev->mode == SCULLP_MODE_MPSC)
+        smp_mb();
+
+    // below rx_lowat, data only count once the flush timer went off
+    avail = reader_avail(filp);
+    if(avail && (avail >= sdev->rx_lowat || READ_ONCE(sdev->flush_due)))
+        mask |= SCULLP_POLLIN;
+    else if(avail && sdev->flush_usecs && !timer_pending(&sdev->flush_timer))
+        mod_timer(&sdev->flush_timer, jiffies + usecs_to_jiffies(sdev->flush_usecs));
+    if(writer_avail(filp) >= sdev->tx_lowat)
+        mask |= SCULLP_POLLOUT;
+    return mask;
+}
+
+/*
+ * replace the ring by one of bufsize bytes, buffered data move to its begin
+ * and BCAST cursors follow them. Readers and writers of SPSC and MMAP modes
+ * touch the ring without sem, so those modes refuse with -EBUSY.
+ */
+static long scullp_resize(struct scullp_cdev *sdev, size_t bufsize)
+{
+    struct scullp_file *sf;
+    struct page **pages;
+    size_t off, chunk, used;
+    long err = 0;
+
+    if(bufsize < 2 || bufsize > SCULLP_MAX_BUFSIZE)
+        return -EINVAL;
+    bufsize = PAGE_ALIGN(bufsize);
     if(down_interruptible(&sdev->sem))
         return -ERESTARTSYS;
+    if(sdev->mode == SCULLP_MODE_SPSC || sdev->mode == SCULLP_MODE_MMAP) {
+        err = -EBUSY;
+        goto done;
+    }
+    used = ring_used(sdev, sdev->rp, sdev->wp);
+    if(used > bufsize - 1) {
+        err = -ENOSPC;
+        goto done;
+    }
+    pages = scullp_ring_alloc(bufsize);
+    if(!pages) {
+        err = -ENOMEM;
+        goto done;
+    }
 
-    while((wcount=writerspace_avail(sdev)) == 0) {
-        up(&sdev->sem);
-        if(filp->f_flags & O_NONBLOCK)
-            return -EAGAIN;
-
-        init_wait(&write_wait);
-        prepare_to_wait(&sdev->outq, &write_wait, TASK_INTERRUPTIBLE);
-        ALOGD("%s: proc writing is going to sleep...", current->comm);
-        if((wcount=writerspace_avail(sdev)) == 0)
-            schedule();
-        finish_wait(&sdev->outq, &write_wait);
-        if(signal_pending(current))
-            return -ERESTARTSYS;
-        if(down_interruptible(&sdev->sem))
-            return -ERESTARTSYS;
+    for(off = 0; off < used; off += chunk) {
+        chunk = min_t(size_t, used - off, PAGE_SIZE);
+        ring_read(sdev, ring_advance(sdev, sdev->rp, off), \
+                page_address(pages[off >> PAGE_SHIFT]), chunk);
     }
-    wcount = min(wcount, count);
-    // wrap around before writing buffer
-    ALOGV("writing: now we have %lu bytes of free space to write", wcount);
+    list_for_each_entry(sf, &sdev->readers, node)
+        sf->rp = ring_used(sdev, sdev->rp, sf->rp);
+    scullp_ring_free(sdev->pages, sdev->bufsize);
+    sdev->pages = pages;
+    sdev->bufsize = bufsize;
+    sdev->rp = 0;
+    sdev->wp = used;
+    if(sdev->ctl)
+        sdev->ctl->size = bufsize;
+    if(sdev->spill.used)
+        spill_to_ring(sdev);
+    sdev->rx_lowat = min(sdev->rx_lowat, bufsize - 1);
+    sdev->tx_lowat = min(sdev->tx_lowat, bufsize - 1);
+    ALOGD("%s%d: ring resized to %zu bytes, %zu buffered", DEV_NAME, sdev->index, bufsize, used);
 
-    if(copy_from_user(sdev->wp, buf, wcount)) {
-        err = -EFAULT;
+    // writers waiting for more room than left recheck and fail
+    wake_up_interruptible_all(&sdev->outq);
+    signal_writers(sdev);
+
+done:
+    up(&sdev->sem);
+    return err;
+}
+
+static void scullp_get_status(struct scullp_cdev *sdev, struct scullp_status *st)
+{
+    struct scullp_stats sum;
+
+    st->bufsize = sdev->bufsize;
+    st->used = scullp_occupancy(sdev);
+    st->space = spill_on(sdev) ? writerspace_avail(sdev) : \
+        sdev->bufsize - 1 - min_t(size_t, st->used, sdev->bufsize - 1);
+    st->spilled = sdev->spill.used;
+    scullp_stats_sum(sdev, &sum);
+    st->nreads = sum.ops[SCULLP_RD];
+    st->nwrites = sum.ops[SCULLP_WR];
+    st->rbytes = sum.bytes[SCULLP_RD];
+    st->wbytes = sum.bytes[SCULLP_WR];
+    st->nreaders = sdev->nreaders;
+    st->nwriters = sdev->nwriters;
+    st->pad = 0;
+}
+
+/*
+ * apply a new configuration. The mode only changes on an empty ring and
+ * when filp is the only one open, since every mode keeps its own
+ * reader and writer bookkeeping.
+ */
+static long scullp_set_config(struct file *filp, struct scullp_config *cfg)
+{
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+    int self = !!(filp->f_mode & FMODE_READ) + !!(filp->f_mode & FMODE_WRITE);
+    struct scullp_lane *lane;
+    long err = 0;
+
+    if(cfg->mode >= SCULLP_MODE_MAX || (cfg->flags & ~SCULLP_F_MASK) || \
+            cfg->rx_lowat < 1 || cfg->tx_lowat < 1)
+        return -EINVAL;
+    if(down_interruptible(&sdev->sem))
+        return -ERESTARTSYS;
+    if(cfg->rx_lowat > sdev->bufsize - 1 || cfg->tx_lowat > sdev->bufsize - 1) {
+        err = -EINVAL;
+        goto done;
+    }
+    if(cfg->mode != sdev->mode) {
+        if(sdev->nreaders + sdev->nwriters > self || scullp_occupancy(sdev)) {
+            err = -EBUSY;
+            goto done;
+        }
+        if(cfg->mode == SCULLP_MODE_MPSC && (filp->f_mode & FMODE_WRITE)) {
+            lane = lane_alloc(sdev->lane_size);
+            if(!lane) {
+                err = -ENOMEM;
+                goto done;
+            }
+            lane_add(sdev, lane);
+            sf->lane = lane;
+        }
+        if(sdev->mode == SCULLP_MODE_BCAST)
+            list_del_init(&sf->node);
+        if(sdev->mode == SCULLP_MODE_MPSC) {
+            scullp_lanes_free(sdev);
+            sf->lane = NULL;
+        }
+        // filp is the only opener, so the only role holder
+        sdev->ring_roles = 0;
+        sf->role = SCULLP_ROLE_NONE;
+        sdev->rp = sdev->wp = 0;
+        // an earlier MMAP session may have left indices beyond a ring
+        // resized since, and flags of sleepers long gone
+        if(cfg->mode == SCULLP_MODE_MMAP) {
+            sdev->ctl->head = sdev->ctl->tail = 0;
+            sdev->ctl->rwaiting = sdev->ctl->wwaiting = 0;
+            sdev->ctl->size = sdev->bufsize;
+        }
+        if(cfg->mode == SCULLP_MODE_BCAST && (filp->f_mode & FMODE_READ)) {
+            sf->rp = 0;
+            list_add_tail(&sf->node, &sdev->readers);
+        }
+        sdev->mode = cfg->mode;
+    }
+    // spilled data would be stranded without the flag
+    if(sdev->spill.used && !(cfg->flags & SCULLP_F_SPILL)) {
+        err = -EBUSY;
         goto done;
     }
-    sdev->wp += wcount;
-    f_pos += wcount;
-    err = wcount;
-    if(sdev->wp == sdev->buf_end)
-        sdev->wp = sdev->buf_begin;
-    ALOGD("%s: did write %li bytes", current->comm, wcount);
+    sdev->flags = cfg->flags;
+    sdev->spill_max = cfg->spill_max;
+    sdev->rx_lowat = cfg->rx_lowat;
+    sdev->tx_lowat = cfg->tx_lowat;
+    sdev->flush_usecs = cfg->flush_usecs;
 
-    wake_up_interruptible(&sdev->inq);
+    // sleepers recheck against the new thresholds
+    wake_up_interruptible_all(&sdev->inq);
+    wake_up_interruptible_all(&sdev->outq);
 
 done:
     up(&sdev->sem);
     return err;
 }
 
+/*
+ * our ioctl return non-negative on success, negative on failure
+ */
 long scullp_ioctl(struct file* filp, unsigned int cmd, unsigned long argp)
 {
-    return 0;
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+    struct scullp_status st;
+    struct scullp_config cfg;
+    u64 bufsize;
+    long retval = 0;
+
+    // checking cmd type and NR to assure this is a valid scullpipe cmd
+    if(_IOC_TYPE(cmd) != SCULLP_IOC_MAGIC) return -ENOTTY;
+    if(_IOC_NR(cmd) >= MAXNR) return -ENOTTY;
+
+    switch(_IOC_NR(cmd)) {
+        case RWAIT:
+        case WWAIT:
+            if(sdev->mode != SCULLP_MODE_MMAP)
+                return -EINVAL;
+            if(sf->role != (_IOC_NR(cmd) == RWAIT ? SCULLP_ROLE_CONSUMER : SCULLP_ROLE_PRODUCER))
+                return -EBADF;
+            retval = ring_ctl_wait(filp, _IOC_NR(cmd) == RWAIT);
+            break;
+        case RWAKE:
+            if(sdev->mode != SCULLP_MODE_MMAP)
+                return -EINVAL;
+            if(sf->role != SCULLP_ROLE_PRODUCER)
+                return -EBADF;
+            wake_readers(sdev);
+            signal_readers(sdev);
+            break;
+        case WWAKE:
+            if(sdev->mode != SCULLP_MODE_MMAP)
+                return -EINVAL;
+            if(sf->role != SCULLP_ROLE_CONSUMER)
+                return -EBADF;
+            wake_writers(sdev);
+            signal_writers(sdev);
+            break;
+        case ROLE:
+            retval = ring_ctl_claim(filp, argp);
+            break;
+        case ADDDEV:
+            if(!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            retval = scullp_add_device();
+            break;
+        case RECVV:
+            retval = packet_recvv(filp, (struct scullp_recvv __user *)argp);
+            break;
+        case READT:
+            retval = scullp_readt(filp, (struct scullp_readt __user *)argp);
+            break;
+        case GSTATUS:
+            scullp_get_status(sdev, &st);
+            if(copy_to_user((void __user *)argp, &st, sizeof(st)))
+                return -EFAULT;
+            break;
+        case RESIZE:
+            if(!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            if(get_user(bufsize, (u64 __user *)argp))
+                return -EFAULT;
+            retval = scullp_resize(sdev, bufsize);
+            break;
+        case GCONFIG:
+            memset(&cfg, 0, sizeof(cfg));
+            cfg.mode = sdev->mode;
+            cfg.flags = sdev->flags;
+            cfg.rx_lowat = sdev->rx_lowat;
+            cfg.tx_lowat = sdev->tx_lowat;
+            cfg.flush_usecs = sdev->flush_usecs;
+            cfg.spill_max = sdev->spill_max;
+            if(copy_to_user((void __user *)argp, &cfg, sizeof(cfg)))
+                return -EFAULT;
+            break;
+        case SCONFIG:
+            if(!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            if(copy_from_user(&cfg, (void __user *)argp, sizeof(cfg)))
+                return -EFAULT;
+            retval = scullp_set_config(filp, &cfg);
+            break;
+        default:
+            retval = -ENOTTY;
+            break;
+    }
+
+    return retval;
 }
 
 int scullp_open(struct inode* inode, struct file* filp)
 {
     struct scullp_cdev *sdev;
-    void *ptr;
+    struct scullp_file *sf;
+    struct page **pages;
+    int err = 0;
 
     sdev = container_of(inode->i_cdev, struct scullp_cdev, cdev);
-    filp->private_data = sdev;
+    sf = kzalloc(sizeof(struct scullp_file), GFP_KERNEL);
+    if(!sf)
+        return -ENOMEM;
+    sf->sdev = sdev;
+    INIT_LIST_HEAD(&sf->node);
+    filp->private_data = sf;
 
-    if(down_interruptible(&sdev->sem))
+    if(down_interruptible(&sdev->sem)) {
+        kfree(sf);
         return -ERESTARTSYS;
+    }
+    // SPSC mode relies on a single reader and a single writer, MMAP mode
+    // checks the same once the sides are claimed, see ring_ctl_claim()
+    if(sdev->mode == SCULLP_MODE_SPSC && \
+            (((filp->f_mode & FMODE_READ) && sdev->nreaders) || \
+             ((filp->f_mode & FMODE_WRITE) && sdev->nwriters))) {
+        err = -EBUSY;
+        goto fail;
+    }
     // initialise buffer for the first time
-    if(!sdev->buf_begin) {
-        ptr = kmalloc(sdev->bufsize, GFP_KERNEL);
-        if(!ptr) {
+    if(!sdev->pages) {
+        pages = scullp_ring_alloc(sdev->bufsize);
+        if(!pages) {
             ALOGD("error: unable to allocate buffer memory!");
-            return -ENOMEM;
+            err = -ENOMEM;
+            goto fail;
         } else {
             ALOGV("size(%lu) buffer is allocated.", sdev->bufsize);
-            sdev->rp = sdev->wp = sdev->buf_begin = ptr;
-            sdev->buf_end = sdev->buf_begin + sdev->bufsize;
+            sdev->pages = pages;
+            sdev->rp = sdev->wp = 0;
+        }
+    }
+    if(!sdev->ctl) {
+        sdev->ctl = (struct scullp_ring_ctl *)get_zeroed_page(GFP_KERNEL);
+        if(!sdev->ctl) {
+            err = -ENOMEM;
+            goto fail;
         }
+        sdev->ctl->size = sdev->bufsize;
     }
+    // an MPSC writer stages its data in a lane of its own
+    if(sdev->mode == SCULLP_MODE_MPSC && (filp->f_mode & FMODE_WRITE)) {
+        sf->lane = lane_alloc(sdev->lane_size);
+        if(!sf->lane) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        lane_add(sdev, sf->lane);
+    }
+    // a BCAST reader only gets what is written from now on
+    if(sdev->mode == SCULLP_MODE_BCAST && (filp->f_mode & FMODE_READ)) {
+        sf->rp = sdev->wp;
+        list_add_tail(&sf->node, &sdev->readers);
+    }
+    if(filp->f_mode & FMODE_READ)
+        sdev->nreaders++;
+    if(filp->f_mode & FMODE_WRITE)
+        sdev->nwriters++;
     ALOGV("device opened successfully with flags(0x%x)", filp->f_flags);
 
     up(&sdev->sem);
     return 0;
+
+fail:
+    up(&sdev->sem);
+    kfree(sf);
+    return err;
+}
+
+/*
+ * readers are notified thru async_queue and writers thru async_wqueue,
+ * a file opened for both goes on both queues
+ */
+int scullp_fasync(int fd, struct file *filp, int mode)
+{
+    struct scullp_cdev *sdev = scullp_dev(filp);
+    int err = 0;
+
+    if(filp->f_mode & FMODE_READ)
+        err = fasync_helper(fd, filp, mode, &sdev->async_queue);
+    if(err >= 0 && (filp->f_mode & FMODE_WRITE))
+        err = fasync_helper(fd, filp, mode, &sdev->async_wqueue);
+    return err < 0 ? err : 0;
 }
 
 int scullp_release(struct inode *inode, struct file *filp)
 {
+    struct scullp_file *sf = filp->private_data;
+    struct scullp_cdev *sdev = sf->sdev;
+
+    // remove this file from the asynchronously notified list
+    scullp_fasync(-1, filp, 0);
+    down(&sdev->sem);
+    if(filp->f_mode & FMODE_READ)
+        sdev->nreaders--;
+    if(filp->f_mode & FMODE_WRITE)
+        sdev->nwriters--;
+    if(sf->role)
+        sdev->ring_roles &= ~(1 << sf->role);
+    // a leaving BCAST reader may have been the one holding writers back
+    if(!list_empty(&sf->node)) {
+        list_del(&sf->node);
+        bcast_update(sdev);
+        wake_writers(sdev);
+    }
+    // staged data outlive the writer, the reader frees a drained lane
+    if(sf->lane) {
+        if(lane_used(sf->lane, sf->lane->rp, sf->lane->wp))
+            sf->lane->orphan = true;
+        else
+            lane_free(sdev, sf->lane);
+    }
+    up(&sdev->sem);
+    kfree(sf);
     return 0;
 }
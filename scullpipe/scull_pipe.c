@@ -1,77 +1,201 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/slab.h>
 #include "scullpipe.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
-// only visible in module init and exit
-static struct scullp_cdev gscullp_dev;
+// room for SCULLP_MAX_DEVS instances, the first gnr_devs of them live and
+// walked by /proc/driver/scullpipe; more are added by the ADDDEV ioctl
+struct scullp_cdev *gscullp_devs;
+int gnr_devs = 1;
+static DEFINE_MUTEX(gdevs_lock);    // serialises adding instances
 static int gbufsize = BUFSIZE;
+// per instance buffer size, falls back to gbufsize when not given
+static int gbufsizes[SCULLP_MAX_DEVS];
+static int gnr_bufsizes;
+static int gmode = SCULLP_MODE_STREAM;
+static unsigned int gflags;
+// wakeup watermarks in bytes and the flush timeout of data below grx_lowat
+static int grx_lowat = 1, gtx_lowat = 1;
+static unsigned int gflush_usecs = 1000;
+// bytes of each writer lane in MPSC mode
+static int glane_size = 1 << 16;
+// bytes the spill store of SCULLP_F_SPILL may hold
+static unsigned long gspill_max = 1 << 26;
 static unsigned int gmajor, gminor;
+module_param(gnr_devs, int, S_IRUGO);
 module_param(gbufsize, int, S_IRUGO);
+module_param_array(gbufsizes, int, &gnr_bufsizes, S_IRUGO);
+module_param(gmode, int, S_IRUGO);
+module_param(gflags, uint, S_IRUGO);
+module_param(grx_lowat, int, S_IRUGO);
+module_param(gtx_lowat, int, S_IRUGO);
+module_param(gflush_usecs, uint, S_IRUGO);
+module_param(glane_size, int, S_IRUGO);
+module_param(gspill_max, ulong, S_IRUGO);
 
 static struct file_operations scullp_fops = {
     .owner          = THIS_MODULE,
     .open           = scullp_open,
     .read           = scullp_read,
     .write          = scullp_write,
+    .poll           = scullp_poll,
+    .fasync         = scullp_fasync,
+    .unlocked_ioctl = scullp_ioctl,
     .compat_ioctl   = scullp_ioctl,
+    .mmap           = scullp_mmap,
     .llseek         = scullp_llseek,
     .release        = scullp_release,
 };
 
-static void init_device(struct scullp_cdev *sdev)
+static int init_device(struct scullp_cdev *sdev, int index)
 {
+    int bufsize = (index < gnr_bufsizes && gbufsizes[index] > 1)? gbufsizes[index] : gbufsize;
+
     // initialise some device specific variables
-    gscullp_dev.bufsize = gbufsize;
+    sdev->index = index;
+    // the ring is made of whole pages
+    sdev->bufsize = PAGE_ALIGN((size_t)max(bufsize, 2));
+    sdev->mode = (gmode >= 0 && gmode < SCULLP_MODE_MAX)? gmode : SCULLP_MODE_STREAM;
+    sdev->flags = gflags;
+    // a watermark above bufsize - 1 bytes could never be reached
+    sdev->rx_lowat = clamp_t(int, grx_lowat, 1, sdev->bufsize - 1);
+    sdev->tx_lowat = clamp_t(int, gtx_lowat, 1, sdev->bufsize - 1);
+    sdev->flush_usecs = gflush_usecs;
+    timer_setup(&sdev->flush_timer, scullp_flush_timeout, 0);
     sema_init(&sdev->sem, 1);
     init_waitqueue_head(&sdev->inq);
     init_waitqueue_head(&sdev->outq);
+    init_waitqueue_head(&sdev->readtq);
+    INIT_LIST_HEAD(&sdev->readers);
+    INIT_LIST_HEAD(&sdev->lanes);
+    sdev->lane_size = max(glane_size, 2);
+    sdev->spill_max = gspill_max;
+    sdev->stats = alloc_percpu(struct scullp_stats);
+    return sdev->stats ? 0 : -ENOMEM;
+}
+
+/*
+ * bring up instance index, ready before it goes live
+ */
+static int add_device(int index)
+{
+    struct scullp_cdev *sdev = &gscullp_devs[index];
+    int err;
+
+    err = init_device(sdev, index);
+    if(err) {
+        ALOGD("error: unable to allocate statistics of device %d", index);
+        goto fail;
+    }
+    cdev_init(&sdev->cdev, &scullp_fops);
+    sdev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&sdev->cdev, MKDEV(gmajor, gminor + index), 1);
+    if(err) {
+        ALOGD("error: unable to register char device %d to kernel", index);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    free_percpu(sdev->stats);
+    sdev->stats = NULL;
+    return err;
+}
+
+/*
+ * add an instance while the module is loaded, return its index, which is
+ * also its minor offset
+ */
+int scullp_add_device(void)
+{
+    int index, err;
+
+    mutex_lock(&gdevs_lock);
+    index = gnr_devs;
+    if(index >= SCULLP_MAX_DEVS)
+        err = -ENOSPC;
+    else if(!(err = add_device(index))) {
+        // /proc reads gnr_devs without the lock
+        smp_store_release(&gnr_devs, index + 1);
+        err = index;
+    }
+    mutex_unlock(&gdevs_lock);
+    if(err >= 0)
+        ALOGD("%s%d: instance added", DEV_NAME, index);
+    return err;
 }
 
 static int __init scullp_init(void)
 {
     dev_t devt;
-    int err;
+    int err, index;
 
-    // allocate device number
-    err = alloc_chrdev_region(&devt, 0, 1, DEV_NAME);
+    if(gnr_devs <= 0 || gnr_devs > SCULLP_MAX_DEVS) {
+        ALOGD("error: gnr_devs should be within [1, %d]", SCULLP_MAX_DEVS);
+        return -EINVAL;
+    }
+    gscullp_devs = kcalloc(SCULLP_MAX_DEVS, sizeof(struct scullp_cdev), GFP_KERNEL);
+    if(!gscullp_devs)
+        return -ENOMEM;
+
+    // allocate device numbers, for the instances added later too
+    err = alloc_chrdev_region(&devt, 0, SCULLP_MAX_DEVS, DEV_NAME);
     if(err < 0) {
         ALOGD("error: failed to allocate device number");
-        return err;
+        goto fail_free;
     }
     gmajor = MAJOR(devt);
     gminor = MINOR(devt);
 
-    // register char device
-    cdev_init(&gscullp_dev.cdev, &scullp_fops);
-    
-    gscullp_dev.cdev.ops = &scullp_fops;
-    err = cdev_add(&gscullp_dev.cdev, devt, 1);
-
-    if(err) {
-        ALOGD("error: unable to register char device to kernel");
-        goto fail;
+    // register char devices
+    for(index = 0; index < gnr_devs; index++) {
+        err = add_device(index);
+        if(err)
+            goto fail;
     }
-    init_device(&gscullp_dev);
+    proc_create("driver/" DEV_NAME, 0, NULL, &scullp_proc_fops);
 
-    ALOGD("%s module is inserted to kernel", DEV_NAME);
-    return err;
+    ALOGD("%s module is inserted to kernel with %d devices", DEV_NAME, gnr_devs);
+    return 0;
 
 fail:
-    unregister_chrdev_region(devt, 1);
+    while(index-- > 0) {
+        cdev_del(&gscullp_devs[index].cdev);
+        del_timer_sync(&gscullp_devs[index].flush_timer);
+        free_percpu(gscullp_devs[index].stats);
+    }
+    unregister_chrdev_region(devt, SCULLP_MAX_DEVS);
+fail_free:
+    kfree(gscullp_devs);
     return err;
 }
 
 static void __exit scullp_exit(void)
 {
     dev_t devt = MKDEV(gmajor, gminor);
+    int index;
 
-    cdev_del(&gscullp_dev.cdev);
-    unregister_chrdev_region(devt, 1);
+    remove_proc_entry("driver/" DEV_NAME, NULL);
+    for(index = 0; index < gnr_devs; index++) {
+        cdev_del(&gscullp_devs[index].cdev);
+        del_timer_sync(&gscullp_devs[index].flush_timer);
+        free_page((unsigned long)gscullp_devs[index].ctl);
+        scullp_ring_free(gscullp_devs[index].pages, gscullp_devs[index].bufsize);
+        scullp_lanes_free(&gscullp_devs[index]);
+        scullp_spill_trim(&gscullp_devs[index].spill);
+        free_percpu(gscullp_devs[index].stats);
+    }
+    unregister_chrdev_region(devt, SCULLP_MAX_DEVS);
+    kfree(gscullp_devs);
     ALOGD("%s module is removed from kernel", DEV_NAME);
 }
 
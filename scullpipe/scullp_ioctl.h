@@ -0,0 +1,152 @@
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Shared ring of SCULLP_MODE_MMAP, mapped by mmap() on offset 0 as:
+ *   page 0:            struct scullp_ring_ctl
+ *   page 1 and up:     ring data, ctl.size bytes
+ *
+ * head is only stored by the producer and tail only by the consumer, both
+ * are offsets into the ring data. As with read() and write(), one byte is
+ * kept free, so head == tail means empty and head+1 == tail means full.
+ *
+ * mmap() needs a file opened for reading, and for writing too to share the
+ * ring writable, so both sides open O_RDWR and then claim their side with
+ * the ROLE ioctl, SCULLP_ROLE_CONSUMER or SCULLP_ROLE_PRODUCER, one file
+ * each. RWAIT and WWAKE belong to the consumer, WWAIT and RWAKE to the
+ * producer.
+ *
+ * The producer publishes head with a release store after copying the data,
+ * the consumer publishes tail with a release store after consuming it.
+ * Before sleeping in RWAIT (WWAIT) or poll the kernel sets rwaiting
+ * (wwaiting); after publishing head (tail) and a full barrier, the other
+ * side only needs the RWAKE (WWAKE) ioctl if it sees the flag set.
+ *
+ * Both flags are owned by the kernel, userspace only reads them. A flag
+ * is cleared when its sleeper wakes up in RWAIT (WWAIT) or when poll
+ * finds the ring ready for it. Since the flag is dropped once poll reports
+ * ready, poll and epoll users must be level triggered: with EPOLLET
+ * nothing sets the flag again before the next wait, and the wakeup is
+ * missed.
+ */
+struct scullp_ring_ctl {
+    __u32 head;
+    __u32 tail;
+    __u32 size;
+    __u32 rwaiting;     // consumer sleeps on an empty ring
+    __u32 wwaiting;     // producer sleeps on a full ring
+};
+
+enum {
+    SCULLP_ROLE_NONE    = 0,
+    SCULLP_ROLE_CONSUMER,
+    SCULLP_ROLE_PRODUCER,
+};
+
+/*
+ * per device behaviour flags
+ * WAITALL: read and write block till the whole count can be transferred
+ * OVERRUN: in BCAST mode, drop data of the slowest readers rather than
+ *          blocking the writer
+ * SPILL: in STREAM mode, writes overflow from a full ring into a bounded
+ *        spill store instead of blocking
+ */
+#define SCULLP_F_WAITALL        (1 << 0)
+#define SCULLP_F_OVERRUN        (1 << 1)
+#define SCULLP_F_NONBLOCK       (1 << 2)    // every open file acts as O_NONBLOCK
+#define SCULLP_F_SPILL          (1 << 3)    // STREAM mode overflows to a spill store
+#define SCULLP_F_MASK           (SCULLP_F_WAITALL | SCULLP_F_OVERRUN | SCULLP_F_NONBLOCK | \
+                                 SCULLP_F_SPILL)
+
+/*
+ * batched dequeue of PACKET mode: buf and lens are user pointers, up to
+ * nrec records are packed back to back in buf (buflen bytes) and the
+ * length of the i-th one is stored in lens[i]
+ */
+struct scullp_recvv {
+    __u64 buf;
+    __u64 buflen;
+    __u64 lens;
+    __u32 nrec;
+    __u32 pad;
+};
+
+/*
+ * GSTATUS: occupancy and counters of an instance, used and space are
+ * bytes buffered for the slowest reader and bytes left for writers
+ */
+struct scullp_status {
+    __u64 bufsize;
+    __u64 used;
+    __u64 space;
+    __u64 nreads;
+    __u64 nwrites;
+    __u64 rbytes;
+    __u64 wbytes;
+    __u32 nreaders;
+    __u32 nwriters;
+    __u32 pad;
+    __u64 spilled;      // part of used held in the spill store
+};
+
+/*
+ * GCONFIG / SCONFIG: per instance behaviour, mode is SCULLP_MODE_*, flags
+ * SCULLP_F_*, both watermarks within [1, bufsize-1]. RESIZE takes the new
+ * bufsize as a __u64 and keeps what is buffered.
+ */
+struct scullp_config {
+    __u32 mode;
+    __u32 flags;
+    __u64 rx_lowat;
+    __u64 tx_lowat;
+    __u32 flush_usecs;
+    __u32 pad;
+    __u64 spill_max;    // bytes the spill store may hold
+};
+
+/*
+ * READT: timed batched read, waits up to timeout_us for min_bytes to be
+ * buffered and then reads up to count bytes into buf, however many are
+ * there; fails with ETIMEDOUT if none came. buf is a user pointer.
+ */
+struct scullp_readt {
+    __u64 buf;
+    __u64 count;
+    __u64 min_bytes;
+    __u64 timeout_us;
+};
+
+enum {
+    RWAIT   = 0,
+    WWAIT,
+    RWAKE,
+    WWAKE,
+    RECVV,
+    GSTATUS,
+    RESIZE,
+    GCONFIG,
+    SCONFIG,
+    READT,
+    ROLE,
+    ADDDEV,
+    MAXNR   = 12,
+};
+
+/*
+ * IOCTL defines for scullpipe driver
+ */
+#define SCULLP_IOC_MAGIC    'p'
+
+#define SCULLP_IOCRWAIT     _IO(SCULLP_IOC_MAGIC, RWAIT)
+#define SCULLP_IOCWWAIT     _IO(SCULLP_IOC_MAGIC, WWAIT)
+#define SCULLP_IOCRWAKE     _IO(SCULLP_IOC_MAGIC, RWAKE)
+#define SCULLP_IOCWWAKE     _IO(SCULLP_IOC_MAGIC, WWAKE)
+#define SCULLP_IOCRECVV     _IOW(SCULLP_IOC_MAGIC, RECVV, struct scullp_recvv)
+#define SCULLP_IOCGSTATUS   _IOR(SCULLP_IOC_MAGIC, GSTATUS, struct scullp_status)
+#define SCULLP_IOCRESIZE    _IOW(SCULLP_IOC_MAGIC, RESIZE, __u64)
+#define SCULLP_IOCGCONFIG   _IOR(SCULLP_IOC_MAGIC, GCONFIG, struct scullp_config)
+#define SCULLP_IOCSCONFIG   _IOW(SCULLP_IOC_MAGIC, SCONFIG, struct scullp_config)
+#define SCULLP_IOCREADT     _IOW(SCULLP_IOC_MAGIC, READT, struct scullp_readt)
+#define SCULLP_IOCROLE      _IO(SCULLP_IOC_MAGIC, ROLE)
+// add an instance, returns its minor offset from the first one
+#define SCULLP_IOCADDDEV    _IO(SCULLP_IOC_MAGIC, ADDDEV)
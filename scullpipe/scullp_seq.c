@@ -0,0 +1,76 @@
+/*
+ * /proc/driver/scullpipe, a block of lines per instance: its setup, the
+ * transfer counters, sleeps and waits, failed and short transfers, and
+ * the histogram of the occupancy seen by transfers
+ */
+#include <linux/seq_file.h>
+#include "scullpipe.h"
+
+static void *scullp_seq_start(struct seq_file *m, loff_t *pos)
+{
+    if(*pos >= smp_load_acquire(&gnr_devs))
+        return NULL;
+    return gscullp_devs + *pos;
+}
+
+static void scullp_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+static void *scullp_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+    ++*pos;
+    return scullp_seq_start(m, pos);
+}
+
+/*
+ * counters are read without sem, a slightly stale line is good enough
+ */
+static int scullp_seq_show(struct seq_file *m, void *v)
+{
+    struct scullp_cdev *sdev = v;
+    struct scullp_stats sum;
+    int i;
+
+    seq_printf(m, "%s%d: mode-%d flags-0x%x bufsize-%zu used-%zu readers-%d writers-%d\n", \
+            DEV_NAME, sdev->index, sdev->mode, sdev->flags, sdev->bufsize, \
+            scullp_occupancy(sdev), sdev->nreaders, sdev->nwriters);
+    scullp_stats_sum(sdev, &sum);
+    seq_printf(m, "\treads-%llu writes-%llu rbytes-%llu wbytes-%llu\n", \
+            sum.ops[SCULLP_RD], sum.ops[SCULLP_WR], sum.bytes[SCULLP_RD], sum.bytes[SCULLP_WR]);
+    seq_printf(m, "\trsleeps-%llu wsleeps-%llu rwait_ns-%llu wwait_ns-%llu\n", \
+            sum.sleeps[SCULLP_RD], sum.sleeps[SCULLP_WR], \
+            sum.wait_ns[SCULLP_RD], sum.wait_ns[SCULLP_WR]);
+    seq_printf(m, "\treagain-%llu weagain-%llu rshort-%llu wshort-%llu\n", \
+            sum.eagain[SCULLP_RD], sum.eagain[SCULLP_WR], \
+            sum.shorts[SCULLP_RD], sum.shorts[SCULLP_WR]);
+    // one column per 1/SCULLP_HIST_BUCKETS of the capacity
+    seq_printf(m, "\toccupancy-%zu/%zu hist", scullp_occupancy(sdev), scullp_capacity(sdev));
+    for(i = 0; i < SCULLP_HIST_BUCKETS; i++)
+        seq_printf(m, " %llu", sum.hist[i]);
+    seq_putc(m, '\n');
+    seq_printf(m, "\trx_lowat-%zu tx_lowat-%zu flush_usecs-%u spilled-%zu spill_max-%zu\n", \
+            sdev->rx_lowat, sdev->tx_lowat, sdev->flush_usecs, \
+            READ_ONCE(sdev->spill.used), sdev->spill_max);
+    return 0;
+}
+
+static struct seq_operations scullp_seq_ops = {
+    .start  = scullp_seq_start,
+    .show   = scullp_seq_show,
+    .next   = scullp_seq_next,
+    .stop   = scullp_seq_stop,
+};
+
+static int scullp_proc_open(struct inode *inode, struct file *filp)
+{
+    return seq_open(filp, &scullp_seq_ops);
+}
+
+struct file_operations scullp_proc_fops = {
+    .owner      = THIS_MODULE,
+    .open       = scullp_proc_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = seq_release,
+};
@@ -1,11 +1,21 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/timer.h>
 #include <linux/wait.h>
+#include "scullp_ioctl.h"
 
 #define BUFSIZE     (1 << 22)
+// the ring size is kept in the __u32 of scullp_ring_ctl
+#define SCULLP_MAX_BUFSIZE  (1UL << 31)
 #define DEV_NAME    "scullpipe"
+#define SCULLP_MAX_DEVS 64
 
-#define NDEBUG
+// uncomment NDEBUG to enable ALOGV, it prints on every transfer
+//#define NDEBUG
 
 // pad "\n" at the end
 #ifdef NDEBUG
@@ -30,20 +40,165 @@
     ((void) fprintf(stderr, fmt "\n", ## __VA_ARGS__))
 #endif
 
+/*
+ * data path of a scullpipe device
+ * STREAM: any number of readers and writers, serialised on sem
+ * SPSC: one reader and one writer, lock-free on rp/wp
+ * MMAP: one producer and one consumer sharing the ring thru mmap(),
+ *       read() and write() are not available
+ * BCAST: every reader gets every byte thru its own cursor, serialised on sem
+ * PACKET: each write is an atomic record and each read returns one record
+ * MPSC: each writer file stages data in a lane of its own without taking
+ *       sem, readers drain the lanes round robin under sem
+ */
+enum {
+    SCULLP_MODE_STREAM  = 0,
+    SCULLP_MODE_SPSC,
+    SCULLP_MODE_MMAP,
+    SCULLP_MODE_BCAST,
+    SCULLP_MODE_PACKET,
+    SCULLP_MODE_MPSC,
+    SCULLP_MODE_MAX,
+};
+
+/*
+ * spill store of STREAM mode, a FIFO of page sized quanta kept in a chain
+ * of qsets like scull's; head and tail are the qsets read and written, at
+ * byte offsets rpos and wpos
+ */
+#define SCULLP_SPILL_QSET   64
+
+struct scullp_qset {
+    void                **data;
+    struct scullp_qset  *next;
+};
+
+struct scullp_spill {
+    struct scullp_qset  *head, *tail;
+    size_t              rpos, wpos;
+    size_t              used;                   // bytes spilled
+};
+
+/*
+ * per CPU statistics of a device, indexed by SCULLP_RD and SCULLP_WR:
+ * transfers and their bytes, sleeps and the time spent in them, -EAGAIN
+ * returns and transfers that moved less than asked. hist counts transfers
+ * by the occupancy they left, in equal slices of the capacity; an MPSC
+ * write counts by that of its own lane.
+ */
+#define SCULLP_HIST_BUCKETS 8
+
+enum {
+    SCULLP_RD   = 0,
+    SCULLP_WR,
+    SCULLP_NDIR,
+};
+
+struct scullp_stats {
+    u64 ops[SCULLP_NDIR];
+    u64 bytes[SCULLP_NDIR];
+    u64 sleeps[SCULLP_NDIR];
+    u64 wait_ns[SCULLP_NDIR];
+    u64 eagain[SCULLP_NDIR];
+    u64 shorts[SCULLP_NDIR];
+    u64 hist[SCULLP_HIST_BUCKETS];
+};
+
 struct scullp_cdev {
     wait_queue_head_t   inq, outq;              // wait queue for read and write processes
-    char                *buf_begin, *buf_end;   // ptr to begin and end+1 of the buffer
+    wait_queue_head_t   readtq;                 // READT callers, each with its own min_bytes
+    struct page         **pages;                // bufsize/PAGE_SIZE pages of the ring
     size_t             bufsize;
-    char                *rp, *wp;
-    int                 nreads, nwrites;        // numbers of reads and writes
-    struct fsync_struct *async_queue;           // asynchronous reads
+    // offsets into the buffer, in SPSC mode rp is only stored by the reader
+    // and wp by the writer
+    size_t              rp, wp;
+    struct scullp_ring_ctl *ctl;                // control page of MMAP mode
+    unsigned int        ring_roles;             // 1 << SCULLP_ROLE_* claimed in MMAP mode
+    int                 mode;                   // SCULLP_MODE_*
+    unsigned int        flags;                  // SCULLP_F_*
+    // readers are woken once rx_lowat bytes are buffered, writers once
+    // tx_lowat bytes are free; flush_timer wakes readers of fewer bytes
+    // after flush_usecs
+    size_t              rx_lowat, tx_lowat;
+    unsigned int        flush_usecs;
+    struct timer_list   flush_timer;
+    bool                flush_due;              // flush_timer went off
+    int                 nreaders, nwriters;     // numbers of opened readers and writers
+    struct scullp_stats __percpu *stats;
+    int                 index;                  // minor offset of this instance
+    struct list_head    readers;                // scullp_file of BCAST readers
+    // MPSC mode: lanes of the writer files and the lane to drain next,
+    // what they hold is only counted by each of them
+    struct list_head    lanes;
+    int                 nlanes;
+    struct scullp_lane  *cur_lane;
+    size_t              lane_size;
+    // STREAM mode overflow of the ring, up to spill_max bytes
+    struct scullp_spill spill;
+    size_t              spill_max;
+    struct fasync_struct *async_queue;          // asynchronous readers
+    struct fasync_struct *async_wqueue;         // asynchronous writers
     struct semaphore    sem;
     struct cdev         cdev;
 };
 
+/*
+ * MPSC mode staging ring of one writer file. The file's writers fill it
+ * under lock, a reader holding sem empties it, and rp and wp are
+ * published with release stores like in SPSC mode. A lane whose file is
+ * released stays on the list till it is drained. The list is changed under
+ * sem and walked under RCU by those summing up the lanes without it.
+ */
+struct scullp_lane {
+    char                *buf;
+    size_t              size;
+    size_t              rp, wp;
+    struct mutex        lock;
+    wait_queue_head_t   wq;                     // writers waiting for room
+    bool                orphan;                 // its file is gone
+    struct list_head    node;                   // on sdev->lanes
+    struct rcu_head     rcu;
+};
+
+/*
+ * per open file state, kept in filp->private_data
+ */
+struct scullp_file {
+    struct scullp_cdev  *sdev;
+    size_t              rp;                     // read cursor of a BCAST reader
+    bool                overrun;                // BCAST reader lost data
+    struct list_head    node;                   // on sdev->readers
+    struct scullp_lane  *lane;                  // MPSC writer lane
+    int                 role;                   // SCULLP_ROLE_* in MMAP mode
+};
+
+static inline struct scullp_cdev *scullp_dev(struct file *filp)
+{
+    return ((struct scullp_file *)filp->private_data)->sdev;
+}
+
 loff_t scullp_llseek(struct file*, loff_t, int);
 ssize_t scullp_read(struct file*, char __user *, size_t, loff_t *);
 ssize_t scullp_write(struct file*, const char __user *, size_t, loff_t *);
+__poll_t scullp_poll(struct file*, poll_table *);
+int scullp_mmap(struct file*, struct vm_area_struct *);
 int scullp_open(struct inode*, struct file*);
 long scullp_ioctl(struct file*, unsigned int, unsigned long);
+int scullp_add_device(void);
 int scullp_release(struct inode*, struct file*);
+int scullp_fasync(int, struct file*, int);
+size_t scullp_occupancy(struct scullp_cdev *);
+size_t scullp_capacity(struct scullp_cdev *);
+void scullp_stats_sum(struct scullp_cdev *, struct scullp_stats *);
+void scullp_flush_timeout(struct timer_list *);
+struct page **scullp_ring_alloc(size_t);
+void scullp_ring_free(struct page **, size_t);
+void scullp_lanes_free(struct scullp_cdev *);
+void scullp_spill_trim(struct scullp_spill *);
+
+/*
+ * instances of the module and the /proc/driver/scullpipe entry
+ */
+extern struct scullp_cdev *gscullp_devs;
+extern int gnr_devs;
+extern struct file_operations scullp_proc_fops;
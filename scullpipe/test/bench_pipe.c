@@ -0,0 +1,124 @@
+/*
+ * throughput benchmark of writers and one reader on a scullpipe device
+ *
+ * load the module once with gmode=0 (STREAM) and once with gmode=1 (SPSC),
+ * then run the same command against both to compare:
+ *   ./bench_pipe /dev/scullpipe [CHUNK_BYTES] [TOTAL_MB] [WRITERS]
+ * with several writers, compare gmode=0 against gmode=5 (MPSC) to see how
+ * the aggregate rate scales; SPSC and MMAP only take one writer.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MODE_PARAM  "/sys/module/scullpipe/parameters/gmode"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_mode(void)
+{
+    FILE *fp = fopen(MODE_PARAM, "r");
+    int mode = -1;
+
+    if(fp) {
+        if(fscanf(fp, "%d", &mode) != 1)
+            mode = -1;
+        fclose(fp);
+    }
+    return mode;
+}
+
+/*
+ * move total bytes thru fd in chunks, return the number of calls
+ */
+static long transfer(int fd, char *buf, size_t chunk, size_t total, int rd)
+{
+    size_t done;
+    ssize_t n;
+    long ops = 0;
+
+    for(done = 0; done < total; done += n, ops++) {
+        if(rd)
+            n = read(fd, buf, chunk);
+        else
+            n = write(fd, buf, chunk < total - done ? chunk : total - done);
+        if(n < 0) {
+            perror(rd ? "read" : "write");
+            exit(1);
+        }
+    }
+    return ops;
+}
+
+int main(int argc, char **argv)
+{
+    char *driver, *buf;
+    size_t chunk = 64, total;
+    long ops;
+    int i, fd, nwriters = 1, status;
+    double begin, elapsed;
+    pid_t pid;
+
+    if(argc < 2) {
+        printf("./bench_pipe [DRIVER_NAME] [CHUNK_BYTES] [TOTAL_MB] [WRITERS]\n");
+        return -1;
+    }
+    driver = argv[1];
+    if(argc > 2)
+        chunk = atol(argv[2]);
+    total = (argc > 3 ? atol(argv[3]) : 256) << 20;
+    if(argc > 4 && atoi(argv[4]) > 0)
+        nwriters = atoi(argv[4]);
+    // every writer moves the same share
+    total -= total % nwriters;
+    if(!(buf = malloc(chunk))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(buf, 'x', chunk);
+
+    for(i = 0; i < nwriters; i++) {
+        pid = fork();
+        if(pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if(pid == 0) {
+            if((fd = open(driver, O_WRONLY)) < 0) {
+                fprintf(stderr, "invalid driver name provided: %s\n", driver);
+                exit(1);
+            }
+            begin = now();
+            ops = transfer(fd, buf, chunk, total / nwriters, 0);
+            elapsed = now() - begin;
+            close(fd);
+            printf("mode %d, chunk %zu, writer %d: %.1f MB/s, %.0f writes/s\n", read_mode(), \
+                    chunk, i, total / nwriters / elapsed / (1 << 20), ops / elapsed);
+            return 0;
+        }
+    }
+
+    if((fd = open(driver, O_RDONLY)) < 0) {
+        fprintf(stderr, "invalid driver name provided: %s\n", driver);
+        exit(1);
+    }
+    begin = now();
+    ops = transfer(fd, buf, chunk, total, 1);
+    elapsed = now() - begin;
+    close(fd);
+    for(i = 0; i < nwriters; i++)
+        wait(&status);
+    printf("mode %d, chunk %zu, %d writers: %.1f MB/s, %.0f reads/s\n", read_mode(), chunk, \
+            nwriters, total / elapsed / (1 << 20), ops / elapsed);
+    return 0;
+}
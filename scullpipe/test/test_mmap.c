@@ -0,0 +1,135 @@
+/*
+ * exchange data thru the shared ring of a scullpipe loaded with gmode=2,
+ * the producer and the consumer only enter the kernel to sleep or wake
+ *   ./test_mmap /dev/scullpipe [TOTAL_MB]
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../scullp_ioctl.h"
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define full_barrier()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static void produce(int fd, struct scullp_ring_ctl *ctl, unsigned char *ring, size_t total)
+{
+    unsigned int head = ctl->head, tail, n, i;
+    size_t done = 0;
+
+    while(done < total) {
+        tail = load_acquire(&ctl->tail);
+        // free bytes up to the ring end, one byte is kept free
+        n = tail > head ? tail - head - 1 : ctl->size - head - (tail == 0);
+        if(n == 0) {
+            if(ioctl(fd, SCULLP_IOCWWAIT) < 0) {
+                perror("WWAIT");
+                exit(1);
+            }
+            continue;
+        }
+        if(n > total - done)
+            n = total - done;
+        for(i = 0; i < n; i++)
+            ring[head + i] = (unsigned char)(done + i);
+        head = (head + n) % ctl->size;
+        done += n;
+        store_release(&ctl->head, head);
+        full_barrier();
+        if(load_acquire(&ctl->rwaiting))
+            ioctl(fd, SCULLP_IOCRWAKE);
+    }
+}
+
+static int consume(int fd, struct scullp_ring_ctl *ctl, unsigned char *ring, size_t total)
+{
+    unsigned int tail = ctl->tail, head, n, i;
+    size_t done = 0;
+
+    while(done < total) {
+        head = load_acquire(&ctl->head);
+        n = head >= tail ? head - tail : ctl->size - tail;
+        if(n == 0) {
+            if(ioctl(fd, SCULLP_IOCRWAIT) < 0) {
+                perror("RWAIT");
+                return 1;
+            }
+            continue;
+        }
+        for(i = 0; i < n; i++) {
+            if(ring[tail + i] != (unsigned char)(done + i)) {
+                fprintf(stderr, "corrupted data at byte %zu\n", done + i);
+                return 1;
+            }
+        }
+        tail = (tail + n) % ctl->size;
+        done += n;
+        store_release(&ctl->tail, tail);
+        full_barrier();
+        if(load_acquire(&ctl->wwaiting))
+            ioctl(fd, SCULLP_IOCWWAKE);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct scullp_ring_ctl *ctl;
+    size_t total, size;
+    long page = sysconf(_SC_PAGESIZE);
+    void *map;
+    int fd, status;
+    pid_t pid;
+
+    if(argc < 2) {
+        printf("./test_mmap [DRIVER_NAME] [TOTAL_MB]\n");
+        return -1;
+    }
+    total = (argc > 2 ? atol(argv[2]) : 64) << 20;
+
+    pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    // both sides map the ring shared and writable, so both open O_RDWR
+    // and then claim their side of it
+    fd = open(argv[1], O_RDWR);
+    if(fd < 0) {
+        fprintf(stderr, "invalid driver name provided: %s\n", argv[1]);
+        exit(1);
+    }
+    if(ioctl(fd, SCULLP_IOCROLE, pid == 0 ? SCULLP_ROLE_CONSUMER : SCULLP_ROLE_PRODUCER) < 0) {
+        perror("ROLE, is the module loaded with gmode=2?");
+        exit(1);
+    }
+    // the control page tells the ring size
+    map = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED) {
+        size = ((struct scullp_ring_ctl *)map)->size;
+        munmap(map, page);
+        map = mmap(NULL, page + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(map == MAP_FAILED) {
+        perror("mmap, is the module loaded with gmode=2?");
+        exit(1);
+    }
+    ctl = map;
+
+    if(pid == 0)
+        return consume(fd, ctl, (unsigned char *)map + page, total);
+
+    produce(fd, ctl, (unsigned char *)map + page, total);
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "consumer failed\n");
+        return 1;
+    }
+    printf("%zu bytes exchanged thru the shared ring\n", total);
+    return 0;
+}
@@ -3,4 +3,4 @@ module="scullpipe"
 device="scullpipe"
 
 rmmod $module
-rm -rf /dev/$device
+rm -rf /dev/$device /dev/${device}[0-9]*